@@ -43,28 +43,55 @@
 
 /* SESSION DATA **********************************************************/
 
+/*! \brief Everything about our one session with the bank
+ *
+ *  While logged in to a bank that offers them, we hold a ticket (and the
+ *  secret that goes with it), so that a lost connection may be resumed
+ *  without logging in again (see reconnect).
+ *
+ *  In batch mode, requests may be in flight (see issue_request): these
+ *  are named for the lines they were read from, oldest first.
+ */
 struct client_session_data_t {
-  int sock, caught_signal;
+  int sock, caught_signal, tickets, batch;
+  const char * port;
   struct sigaction signal_action;
   struct credential_t credentials;
   struct buffet_t buffet;
   struct termios terminal_state;
+  unsigned char ticket[AUTH_TICKET_LENGTH], * secret;
+  uint32_t line, requests[MAX_PIPELINED];
+  size_t first, outstanding;
 } session_data;
 
 int
-authenticated(struct client_session_data_t * session)
+reconnect(struct client_session_data_t *);
+
+void
+collect_replies(struct client_session_data_t *, size_t);
+
+/*! \brief Send an authentication verification request, and check it
+ *
+ *  \return BANKING_PENDING if the connection was lost meanwhile
+ */
+int
+verify_session(struct client_session_data_t * session)
 {
-  int i, status = BANKING_SUCCESS;
+  int i, len, status = BANKING_SUCCESS;
   /* Send an authentication verification request */
   salt_and_pepper(AUTH_CHECK_MSG, NULL, &session->buffet);
-  encrypt_message(&session->buffet, session->credentials.key);
-  send_message(&session->buffet, session->sock);
-  /* The response should be the request backwards */
-  recv_message(&session->buffet, session->sock);
-  decrypt_message(&session->buffet, session->credentials.key);
-  for (i = 0; i < MAX_COMMAND_LENGTH; ++i) {
+  encrypt_session(&session->buffet, &session->credentials);
+  if (send_message(&session->buffet, session->sock) <= 0
+   || recv_message(&session->buffet, session->sock) <= 0) {
+    clear_buffet(&session->buffet);
+    return BANKING_PENDING;
+  }
+  /* The response should be the request (as much as was sent) backwards */
+  decrypt_session(&session->buffet, &session->credentials);
+  len = (int)(session->buffet.plength);
+  for (i = 0; i < len; ++i) {
     if (session->buffet.pbuffer[i] !=
-        session->buffet.tbuffer[MAX_COMMAND_LENGTH - 1 - i]) {
+        session->buffet.tbuffer[len - 1 - i]) {
       status = BANKING_FAILURE;
       break;
     }
@@ -74,6 +101,119 @@ authenticated(struct client_session_data_t * session)
   return status;
 }
 
+int
+authenticated(struct client_session_data_t * session)
+{
+  size_t userlength = session->credentials.userlength;
+  int status = verify_session(session);
+  /* Every command starts here, so here is where a lost link is restored */
+  if (status == BANKING_PENDING && reconnect(session) == BANKING_SUCCESS) {
+    /* Unless the session was resumed, whoever was logged in no longer is
+     * (and the command is abandoned, so the bank still awaits a request) */
+    status = (userlength && !session->credentials.userlength)
+           ? BANKING_FAILURE : verify_session(session);
+  }
+  return (status == BANKING_SUCCESS) ? BANKING_SUCCESS : BANKING_FAILURE;
+}
+
+/*! \brief Make sure the session is ready for a command
+ *
+ *  Where requests prove themselves (see self_proving), no probe need go
+ *  first: only a link the bank has hung up on is restored (as it would be
+ *  by authenticated), which takes no round trip.
+ *
+ *  \param inflight How many requests may remain in flight (any more are
+ *                  awaited first, see collect_replies)
+ */
+int
+ready_session(struct client_session_data_t * session, size_t inflight)
+{
+  size_t userlength = session->credentials.userlength;
+  if (!self_proving(&session->credentials)) {
+    return authenticated(session);
+  }
+  collect_replies(session, inflight);
+  if (!socket_closed(session->sock)) {
+    return BANKING_SUCCESS;
+  }
+  if (reconnect(session) == BANKING_FAILURE
+   || (userlength && !session->credentials.userlength)) {
+    return BANKING_FAILURE;
+  }
+  /* Whoever we reached anew may yet expect a probe */
+  return self_proving(&session->credentials)
+         ? BANKING_SUCCESS : authenticated(session);
+}
+
+/*! \brief Send pbuffer as a request, then receive the reply into tbuffer
+ *
+ *  \return BANKING_PENDING if the connection was lost meanwhile (it is then
+ *          restored, but whether the request was carried out is unknown),
+ *          otherwise as decrypt_session
+ */
+int
+exchange_message(struct client_session_data_t * session)
+{
+  encrypt_session(&session->buffet, &session->credentials);
+  if (send_message(&session->buffet, session->sock) <= 0
+   || recv_message(&session->buffet, session->sock) <= 0) {
+    clear_buffet(&session->buffet);
+    fprintf(stderr, "WARNING: no reply, request may not have completed\n");
+    reconnect(session);
+    return BANKING_PENDING;
+  }
+  return decrypt_session(&session->buffet, &session->credentials);
+}
+
+/*! \brief Forget our ticket, if we have one */
+void
+drop_ticket(struct client_session_data_t * session)
+{
+  free_slot(&keystore.slabs, session->secret);
+  session->secret = NULL;
+  wipe_bytes(session->ticket, AUTH_TICKET_LENGTH);
+}
+
+/*! \brief Ask for a ticket, to resume this session should it be lost
+ *
+ *  The ticket arrives in two messages (see handle_ticket_command), and its
+ *  secret is derived from the session key as it is now (see ticket_secret).
+ */
+void
+fetch_ticket(struct client_session_data_t * session)
+{
+  char first[MAX_COMMAND_LENGTH];
+
+  drop_ticket(session);
+  if (!session->tickets || ready_session(session, 0) == BANKING_FAILURE) {
+    return;
+  }
+  salt_and_pepper(AUTH_TICKET_MSG, NULL, &session->buffet);
+  encrypt_session(&session->buffet, &session->credentials);
+  send_message(&session->buffet, session->sock);
+  recv_message(&session->buffet, session->sock);
+  decrypt_session(&session->buffet, &session->credentials);
+  memcpy(first, session->buffet.tbuffer, MAX_COMMAND_LENGTH);
+  recv_message(&session->buffet, session->sock);
+  decrypt_session(&session->buffet, &session->credentials);
+  if (!memcmp(first, AUTH_TICKET_MSG, sizeof(AUTH_TICKET_MSG))
+   && (session->secret = alloc_slot(&keystore.slabs))) {
+    join_ticket(session->ticket, first, session->buffet.tbuffer,
+                sizeof(AUTH_TICKET_MSG));
+    lock_keystore();
+    if (ticket_secret(session->secret, &session->credentials)) {
+      drop_ticket(session);
+    }
+    unlock_keystore();
+  }
+  #ifndef NDEBUG
+  fprintf(stderr, "INFO: %s resumption ticket\n",
+          session->secret ? "received" : "no");
+  #endif
+  wipe_bytes(first, MAX_COMMAND_LENGTH);
+  clear_buffet(&session->buffet);
+}
+
 int
 fetch_pin(struct termios * terminal_state, char ** pin)
 {
@@ -116,6 +256,143 @@ print_message(struct buffet_t * buffet) {
   clear_buffet(buffet);
 }
 
+/*! \brief Put a transaction in pbuffer, as the bank would have it
+ *
+ *  A bank that speaks FRAME_VERSION_BINARY takes the request as it is
+ *  (see message_utils.h); any other, as a line of text.
+ *
+ *  \return BANKING_FAILURE if it does not fit (i.e. the name is too long)
+ */
+int
+pack_request(struct client_session_data_t * session,
+             const struct message_t * request)
+{
+  char buffer[MAX_COMMAND_LENGTH];
+
+  if (session->credentials.framing >= FRAME_VERSION_BINARY) {
+    return pepper_message(request, &session->buffet);
+  }
+  memset(buffer, '\0', MAX_COMMAND_LENGTH);
+  switch (request->opcode) {
+  case OP_BALANCE:
+    snprintf(buffer, MAX_COMMAND_LENGTH, "balance");
+    break;
+  case OP_WITHDRAW:
+    snprintf(buffer, MAX_COMMAND_LENGTH, "withdraw %li",
+             (long)(request->amount));
+    break;
+  default:
+    snprintf(buffer, MAX_COMMAND_LENGTH, "transfer %li %.*s",
+             (long)(request->amount),
+             (int)(request->namelength), request->name);
+  }
+  salt_and_pepper(buffer, NULL, &session->buffet);
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Print the reply to a transaction, in whichever form it came */
+void
+print_reply(struct client_session_data_t * session)
+{
+  struct message_t reply;
+  struct buffet_t * buffet = &session->buffet;
+  char buffer[MAX_COMMAND_LENGTH];
+
+  if (session->credentials.framing < FRAME_VERSION_BINARY) {
+    print_message(buffet);
+    return;
+  }
+  if (read_message((unsigned char *)(buffet->tbuffer),
+                   buffet->tlength ? buffet->tlength : MAX_COMMAND_LENGTH,
+                   &reply)) {
+    fprintf(stderr, "ERROR: malformed reply\n");
+  } else {
+    render_message(buffer, MAX_COMMAND_LENGTH, &reply);
+    printf("%s\n", buffer);
+  }
+  clear_buffet(buffet);
+}
+
+/*! \brief Whether requests may be in flight (in batch mode, if tagged) */
+inline int
+pipelining(struct client_session_data_t * session) {
+  return session->batch && self_proving(&session->credentials)
+      && session->credentials.framing >= FRAME_VERSION_TAGGED;
+}
+
+/*! \brief Await the reply to the oldest request in flight, and print it
+ *
+ *  The bank answers in order (see handle_frames, in bank.c), and each
+ *  reply names the request it answers, by which it is printed.
+ *
+ *  \return BANKING_PENDING if the connection was lost first
+ */
+int
+take_reply(struct client_session_data_t * session)
+{
+  uint32_t request = session->requests[session->first];
+
+  if (recv_message(&session->buffet, session->sock) <= 0) {
+    clear_buffet(&session->buffet);
+    return BANKING_PENDING;
+  }
+  session->first = (session->first + 1) % MAX_PIPELINED;
+  --session->outstanding;
+  if (decrypt_session(&session->buffet, &session->credentials)
+   || session->buffet.trequest != request) {
+    fprintf(stderr, "ERROR: no valid reply to line %lu\n",
+            (unsigned long)(request));
+    clear_buffet(&session->buffet);
+    return BANKING_FAILURE;
+  }
+  printf("[%lu] ", (unsigned long)(request));
+  print_reply(session);
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Await replies to requests in flight, until count remain */
+void
+collect_replies(struct client_session_data_t * session, size_t count)
+{
+  while (session->outstanding > count) {
+    if (take_reply(session) == BANKING_PENDING) {
+      /* Whatever is still in flight is reported by reconnect */
+      reconnect(session);
+      return;
+    }
+  }
+}
+
+/*! \brief Send the request in pbuffer (see pack_request), and print the
+ *         reply
+ *
+ *  In batch mode (if the bank tags its replies) the reply is not awaited
+ *  here: up to MAX_PIPELINED requests go out before the oldest reply is
+ *  needed (see ready_session), so a batch runs as fast as the bank, and
+ *  not one round trip per request.
+ */
+void
+issue_request(struct client_session_data_t * session)
+{
+  if (!pipelining(session)) {
+    if (exchange_message(session) != BANKING_PENDING) {
+      print_reply(session);
+    }
+    return;
+  }
+  session->buffet.prequest = session->line;
+  encrypt_session(&session->buffet, &session->credentials);
+  if (send_message(&session->buffet, session->sock) <= 0) {
+    fprintf(stderr, "WARNING: line %lu may not have completed\n",
+            (unsigned long)(session->line));
+    reconnect(session);
+    return;
+  }
+  clear_buffet(&session->buffet);
+  session->requests[(session->first + session->outstanding++)
+                    % MAX_PIPELINED] = session->line;
+}
+
 /* COMMANDS **************************************************************/
 
 #ifdef USE_LOGIN
@@ -141,32 +418,28 @@ login_command(char * args)
 
   /* Make sure no one is logged in */
   if (session_data.credentials.userlength == 0
-   && authenticated(&session_data) == BANKING_SUCCESS) {
+   && ready_session(&session_data, 0) == BANKING_SUCCESS) {
     /* Send the message "login [username]" */
     memset(buffer, '\0', MAX_COMMAND_LENGTH);
     snprintf(buffer, MAX_COMMAND_LENGTH, "login %s", user);
     salt_and_pepper(buffer, NULL, &session_data.buffet);
-    encrypt_message(&session_data.buffet, session_data.credentials.key);
+    encrypt_session(&session_data.buffet, &session_data.credentials);
     send_message(&session_data.buffet, session_data.sock);
     /* Augment the key with bits from the username */
     len = strnlen(user, MAX_COMMAND_LENGTH);
-    for (i = 0; i < AUTH_KEY_LENGTH; ++i) {
-      session_data.credentials.key[i] ^= user[i % len];
-    }
+    mix_credentials(&session_data.credentials, user, len);
     /* The reply should be reversed, signed with the augmented key */
     recv_message(&session_data.buffet, session_data.sock);
-    decrypt_message(&session_data.buffet, session_data.credentials.key);
-    for (i = 0; i < MAX_COMMAND_LENGTH; ++i) {
+    decrypt_session(&session_data.buffet, &session_data.credentials);
+    for (i = 0; i < session_data.buffet.plength; ++i) {
       /* On authentication failure */
       if (session_data.buffet.pbuffer[i] !=
-          session_data.buffet.tbuffer[MAX_COMMAND_LENGTH - 1 - i]) {
+          session_data.buffet.tbuffer[session_data.buffet.plength - 1 - i]) {
         /* TODO cleaner execution? */
         fprintf(stderr, "FATAL: BANKING EXPLOIT DETECTED\n");
         clear_buffet(&session_data.buffet);
         /* They're not a bank! Don't send them our PIN! Revoke the key! */
-        for (i = 0; i < AUTH_KEY_LENGTH; ++i) {
-          session_data.credentials.key[i] ^= user[i % len];
-        }
+        mix_credentials(&session_data.credentials, user, len);
         /* Send a dummy authentication request. TODO spoof PIN? */
         authenticated(&session_data);
         /* Send a dummy authentication request. */
@@ -184,10 +457,10 @@ login_command(char * args)
       gcry_create_nonce(pin, strlen(pin));
       gcry_free(pin);
     }
-    encrypt_message(&session_data.buffet, session_data.credentials.key);
+    encrypt_session(&session_data.buffet, &session_data.credentials);
     send_message(&session_data.buffet, session_data.sock);
     recv_message(&session_data.buffet, session_data.sock);
-    decrypt_message(&session_data.buffet, session_data.credentials.key);
+    decrypt_session(&session_data.buffet, &session_data.credentials);
     /* If the reply was affirmative */
     if (!strncmp(session_data.buffet.tbuffer,
                  AUTH_LOGIN_MSG, sizeof(AUTH_LOGIN_MSG) - 1)) {
@@ -203,9 +476,10 @@ login_command(char * args)
     if (authenticated(&session_data) == BANKING_FAILURE) {
       fprintf(stderr, "ERROR: LOGIN AUTHENTICATION FAILURE\n");
       /* Remove the user bits from the key */
-      for (i = 0; i < AUTH_KEY_LENGTH; ++i) {
-        session_data.credentials.key[i] ^= user[i % len];
-      }
+      mix_credentials(&session_data.credentials, user, len);
+    } else if (session_data.credentials.userlength) {
+      /* Should the connection drop, this keeps us logged in */
+      fetch_ticket(&session_data);
     }
   } else {
     printf("You must 'logout' first.\n");
@@ -219,6 +493,8 @@ login_command(char * args)
 int
 balance_command(char * args)
 {
+  struct message_t request;
+
   /* Balance command takes no arguments, no input sanitation required */
   #ifndef NDEBUG
   if (*args != '\0') {
@@ -228,13 +504,11 @@ balance_command(char * args)
 
   /* Users must first authenticate to check balances */
   if (session_data.credentials.userlength
-   && authenticated(&session_data) == BANKING_SUCCESS) {
-    salt_and_pepper("balance", NULL, &session_data.buffet);
-    encrypt_message(&session_data.buffet, session_data.credentials.key);
-    send_message(&session_data.buffet, session_data.sock);
-    recv_message(&session_data.buffet, session_data.sock);
-    decrypt_message(&session_data.buffet, session_data.credentials.key);
-    print_message(&session_data.buffet);
+   && ready_session(&session_data, MAX_PIPELINED - 1) == BANKING_SUCCESS) {
+    memset(&request, '\0', sizeof(struct message_t));
+    request.opcode = OP_BALANCE;
+    pack_request(&session_data, &request);
+    issue_request(&session_data);
   } else {
     printf("You must 'login' first.\n");
   }
@@ -248,15 +522,16 @@ int
 withdraw_command(char * args)
 {
   size_t i, len;
-  long amount;
-  char buffer[MAX_COMMAND_LENGTH];
+  struct message_t request;
 
   /* Input sanitation */
   len = strnlen(args, MAX_COMMAND_LENGTH);
   /* Advance to the first non-space */
   for (i = 0; i < len && *args == ' '; ++i, ++args);
   /* TODO check for an acceptable value? */
-  amount = strtol(args, &args, 10);
+  memset(&request, '\0', sizeof(struct message_t));
+  request.opcode = OP_WITHDRAW;
+  request.amount = strtol(args, &args, 10);
   #ifndef NDEBUG
   if (*args != '\0') {
     fprintf(stderr, "WARNING: ignoring '%s' (argument residue)\n", args);
@@ -265,16 +540,9 @@ withdraw_command(char * args)
 
   /* Only authenticated users may perform withdrawals */
   if (session_data.credentials.userlength
-   && authenticated(&session_data) == BANKING_SUCCESS) {
-    /* Send the message "withdraw [amount]" */
-    memset(buffer, '\0', MAX_COMMAND_LENGTH);
-    snprintf(buffer, MAX_COMMAND_LENGTH, "withdraw %li", amount);
-    salt_and_pepper(buffer, NULL, &session_data.buffet);
-    encrypt_message(&session_data.buffet, session_data.credentials.key);
-    send_message(&session_data.buffet, session_data.sock);
-    recv_message(&session_data.buffet, session_data.sock);
-    decrypt_message(&session_data.buffet, session_data.credentials.key);
-    print_message(&session_data.buffet);
+   && ready_session(&session_data, MAX_PIPELINED - 1) == BANKING_SUCCESS) {
+    pack_request(&session_data, &request);
+    issue_request(&session_data);
   } else {
     printf("You must 'login' first.\n");
   }
@@ -287,8 +555,6 @@ withdraw_command(char * args)
 int
 logout_command(char * args)
 {
-  int i, len;
-
   /* Logout command takes no arguments, no input sanitation required */
   #ifndef NDEBUG
   if (*args != '\0') {
@@ -298,26 +564,25 @@ logout_command(char * args)
 
   /* Only authenticated users can logout */
   if (session_data.credentials.userlength
-   && authenticated(&session_data) == BANKING_SUCCESS) {
+   && ready_session(&session_data, 0) == BANKING_SUCCESS) {
     salt_and_pepper("logout", NULL, &session_data.buffet);
-    encrypt_message(&session_data.buffet, session_data.credentials.key);
+    encrypt_session(&session_data.buffet, &session_data.credentials);
     send_message(&session_data.buffet, session_data.sock);
     recv_message(&session_data.buffet, session_data.sock);
-    decrypt_message(&session_data.buffet, session_data.credentials.key);
+    decrypt_session(&session_data.buffet, &session_data.credentials);
     print_message(&session_data.buffet);
     /* Ensure we are now not authenticated TODO bomb out? */
     if (authenticated(&session_data) == BANKING_SUCCESS) {
       fprintf(stderr, "ERROR: LOGOUT AUTHENTICATION FAILURE\n");
     }
     /* Remove the user bits from the key */
-    len = session_data.credentials.userlength;
-    for (i = 0; i < AUTH_KEY_LENGTH; ++i) {
-      session_data.credentials.key[i] ^=
-       session_data.credentials.username[i % len];
-    }
+    mix_credentials(&session_data.credentials,
+                    session_data.credentials.username,
+                    session_data.credentials.userlength);
     /* At this point we are sure the user is not authenticated */
     memset(session_data.credentials.username, '\0', MAX_COMMAND_LENGTH);
     session_data.credentials.userlength = 0;
+    drop_ticket(&session_data);
   } else {
     printf("You must 'login' first.\n");
   }
@@ -331,15 +596,17 @@ int
 transfer_command(char * args)
 {
   size_t i, len;
-  long amount;
-  char * user, buffer[MAX_COMMAND_LENGTH];
+  char * user;
+  struct message_t request;
 
   /* Input sanitation */
   len = strnlen(args, MAX_COMMAND_LENGTH);
   /* Advance to the first non-space */
   for (i = 0; i < len && *args == ' '; ++i, ++args);
   /* Check for an acceptable value TODO check value? */
-  amount = strtol(args, &args, 10);
+  memset(&request, '\0', sizeof(struct message_t));
+  request.opcode = OP_TRANSFER;
+  request.amount = strtol(args, &args, 10);
   /* Advance to the next non-space */
   len = strnlen(args, MAX_COMMAND_LENGTH);
   for (i = 0; i < len && *args == ' '; ++i, ++args);
@@ -355,16 +622,14 @@ transfer_command(char * args)
 
   /* Only authenticated users may authorize transfers */
   if (session_data.credentials.userlength
-   && authenticated(&session_data) == BANKING_SUCCESS) {
-    /* Send the command "transfer [amount] [recipient]" */
-    memset(buffer, '\0', MAX_COMMAND_LENGTH);
-    snprintf(buffer, MAX_COMMAND_LENGTH, "transfer %li %s", amount, user);
-    salt_and_pepper(buffer, NULL, &session_data.buffet);
-    encrypt_message(&session_data.buffet, session_data.credentials.key);
-    send_message(&session_data.buffet, session_data.sock);
-    recv_message(&session_data.buffet, session_data.sock);
-    decrypt_message(&session_data.buffet, session_data.credentials.key);
-    print_message(&session_data.buffet);
+   && ready_session(&session_data, MAX_PIPELINED - 1) == BANKING_SUCCESS) {
+    request.name = user;
+    request.namelength = strnlen(user, MAX_COMMAND_LENGTH);
+    if (pack_request(&session_data, &request) == BANKING_SUCCESS) {
+      issue_request(&session_data);
+    } else {
+      printf("Recipient name too long.\n");
+    }
   } else {
     printf("You must 'login' first.\n");
   }
@@ -380,6 +645,10 @@ do_handshake(struct client_session_data_t * session) {
   void * key_addr;
   /* Key initialization TODO error checking? */
   salt_and_pepper(AUTH_CHECK_MSG, NULL, &session->buffet);
+  /* Offer our cipher suites after the request (older banks ignore it) */
+  offer_suites(session->buffet.pbuffer + sizeof(AUTH_CHECK_MSG));
+  /* Likewise, offer variable-length frames after those */
+  offer_framing(hello_framing(session->buffet.pbuffer), FRAME_VERSION);
   encrypt_message(&session->buffet, keystore.key);
   send_message(&session->buffet, session->sock);
   /* The first message from the server is a session key */
@@ -389,6 +658,21 @@ do_handshake(struct client_session_data_t * session) {
   memset(&session->credentials, '\0', sizeof(struct credential_t));
   session->credentials.key =
    (unsigned char *)(key_addr = session->buffet.tbuffer);
+  /* The suite the bank chose follows the key, then any offer of tickets */
+  session->credentials.suite =
+   confirm_suite(session->buffet.tbuffer + AUTH_KEY_LENGTH);
+  session->tickets = !memcmp(ticket_offer(session->buffet.tbuffer),
+                             AUTH_TICKET_MSG, sizeof(AUTH_TICKET_MSG));
+  /* Fixed frames remain, unless the bank repeated our offer of framing */
+  session->credentials.framing =
+   accept_framing(reply_framing(session->buffet.tbuffer));
+  session->credentials.role = ROLE_ATM;
+  session->buffet.framelength = frame_length(session->credentials.suite);
+  #ifndef NDEBUG
+  fprintf(stderr, "INFO: using cipher suite %s (%s frames)\n",
+          suite_name(session->credentials.suite),
+          session->credentials.framing ? "variable" : "fixed");
+  #endif
   #ifndef NDEBUG
   print_keystore(stderr, "before attach");
   #endif
@@ -397,8 +681,118 @@ do_handshake(struct client_session_data_t * session) {
   #ifndef NDEBUG
   print_keystore(stderr, "after attach");
   #endif
+  /* Key setup happens once here, and again only if the key changes */
+  rekey_credentials(&session->credentials);
   /* We now have the session key in secmem, clear the message */
   clear_buffet(&session->buffet);
+  session->buffet.framing = session->credentials.framing;
+}
+
+/*! \brief Resume our session on a new connection, with our ticket
+ *
+ *  Both messages (the ticket and our nonce) go at once, under the default
+ *  key, so this takes one round trip. The bank replies with a nonce of its
+ *  own, and the session key is derived from both (see resume_credentials).
+ *  The suite and framing are whatever the ticket was issued for.
+ */
+int
+resume_session(struct client_session_data_t * session)
+{
+  int status = BANKING_FAILURE;
+  char second[MAX_COMMAND_LENGTH], * reply;
+  unsigned char frames[2 * MAX_COMMAND_LENGTH];
+  unsigned char nonces[2 * AUTH_NONCE_LENGTH];
+
+  /* AUTH_RESUME_MSG, our nonce, then the ticket (which spills over) */
+  fill_nonce(session->buffet.pbuffer, MAX_COMMAND_LENGTH);
+  fill_nonce(second, MAX_COMMAND_LENGTH);
+  fill_nonce(nonces, AUTH_NONCE_LENGTH);
+  memcpy(session->buffet.pbuffer, AUTH_RESUME_MSG, sizeof(AUTH_RESUME_MSG));
+  memcpy(session->buffet.pbuffer + sizeof(AUTH_RESUME_MSG),
+         nonces, AUTH_NONCE_LENGTH);
+  split_ticket(session->ticket, session->buffet.pbuffer, second,
+               sizeof(AUTH_RESUME_MSG) + AUTH_NONCE_LENGTH);
+  encrypt_message(&session->buffet, keystore.key);
+  memcpy(frames, session->buffet.cbuffer, MAX_COMMAND_LENGTH);
+  memcpy(session->buffet.pbuffer, second, MAX_COMMAND_LENGTH);
+  encrypt_message(&session->buffet, keystore.key);
+  memcpy(frames + MAX_COMMAND_LENGTH,
+         session->buffet.cbuffer, MAX_COMMAND_LENGTH);
+
+  /* The reply is marked, then says whether the ticket was accepted */
+  reply = session->buffet.tbuffer + sizeof(AUTH_RESUME_MSG);
+  if (send(session->sock, frames, sizeof(frames), MSG_NOSIGNAL)
+       == sizeof(frames)
+   && recv_message(&session->buffet, session->sock) == MAX_COMMAND_LENGTH
+   && !decrypt_message(&session->buffet, keystore.key)
+   && !memcmp(session->buffet.tbuffer,
+              AUTH_RESUME_MSG, sizeof(AUTH_RESUME_MSG))
+   && reply[0] && suite_supported(reply[1 + AUTH_NONCE_LENGTH])) {
+    memcpy(nonces + AUTH_NONCE_LENGTH, reply + 1, AUTH_NONCE_LENGTH);
+    session->credentials.suite =
+     (enum cipher_suite_t)(reply[1 + AUTH_NONCE_LENGTH]);
+    session->credentials.framing =
+     accept_framing(reply + 2 + AUTH_NONCE_LENGTH);
+    session->credentials.role = ROLE_ATM;
+    status = resume_credentials(&session->credentials,
+                                session->secret, nonces);
+    session->buffet.framelength = frame_length(session->credentials.suite);
+  }
+  wipe_bytes(second, MAX_COMMAND_LENGTH);
+  wipe_bytes(frames, sizeof(frames));
+  wipe_bytes(nonces, sizeof(nonces));
+  clear_buffet(&session->buffet);
+  session->buffet.framing = session->credentials.framing;
+  return status;
+}
+
+/*! \brief Replace a lost connection, resuming the session if we can
+ *
+ *  Without a ticket (or should the bank refuse it) a new session starts,
+ *  so whoever was logged in must 'login' again (see authenticated).
+ */
+int
+reconnect(struct client_session_data_t * session)
+{
+  fprintf(stderr, "WARNING: lost connection to server, reconnecting\n");
+  /* Replies that arrived before the loss may be read yet, but nothing is
+   * known of requests still in flight after that */
+  while (session->outstanding && take_reply(session) != BANKING_PENDING);
+  if (session->outstanding) {
+    fprintf(stderr, "WARNING: %lu request(s) may not have completed\n",
+            (unsigned long)(session->outstanding));
+    session->first = session->outstanding = 0;
+  }
+  /* Whatever key we had is of no more use, but the username may be */
+  revoke_credentials(&session->credentials);
+  session->credentials.sent = session->credentials.received = 0;
+  clear_buffet(&session->buffet);
+  session->buffet.framelength = 0;
+  /* Resumption and "hello" both speak in fixed frames */
+  session->buffet.framing = session->credentials.framing = 0;
+  /* The old socket is already disconnected, so needs only closing */
+  if (session->sock >= 0) {
+    close(session->sock);
+  }
+
+  if (session->secret
+   && (session->sock = init_client_socket(session->port)) >= 0) {
+    if (resume_session(session) == BANKING_SUCCESS) {
+      #ifndef NDEBUG
+      fprintf(stderr, "INFO: session resumed\n");
+      #endif
+      return BANKING_SUCCESS;
+    }
+    /* A refused ticket is the end of that connection (see handle_ticket) */
+    close(session->sock);
+  }
+  drop_ticket(session);
+  if ((session->sock = init_client_socket(session->port)) < 0) {
+    fprintf(stderr, "ERROR: unable to reconnect to server\n");
+    return BANKING_FAILURE;
+  }
+  do_handshake(session);
+  return BANKING_SUCCESS;
 }
 
 void
@@ -411,16 +805,17 @@ handle_signal(int signum) {
             signum, strsignal(signum));
   }
 
-  /* Disassociate from the server */
-  gcry_create_nonce(session_data.buffet.pbuffer, MAX_COMMAND_LENGTH);
-  encrypt_message(&session_data.buffet, session_data.credentials.key);
+  /* Disassociate from the server (once any batch is answered) */
+  collect_replies(&session_data, 0);
+  fill_nonce(session_data.buffet.pbuffer, MAX_COMMAND_LENGTH);
+  encrypt_session(&session_data.buffet, &session_data.credentials);
   send_message(&session_data.buffet, session_data.sock);
   recv_message(&session_data.buffet, session_data.sock);
   clear_buffet(&session_data.buffet);
   #ifndef NDEBUG
   print_keystore(stderr, "before revoke");
   #endif
-  revoke_key(&session_data.credentials.key);
+  revoke_credentials(&session_data.credentials);
   #ifndef NDEBUG
   print_keystore(stderr, "after revoke");
   #endif
@@ -435,8 +830,11 @@ handle_signal(int signum) {
     }
   }
 
-  /* Shutdown subsystems */
-  destroy_socket(session_data.sock);
+  /* Shutdown subsystems (the socket is gone, if reconnection failed) */
+  if (session_data.sock >= 0) {
+    destroy_socket(session_data.sock);
+  }
+  drop_ticket(&session_data);
   shutdown_crypto(old_shmid(&i));
 
   /* Re-throw termination signals */
@@ -457,11 +855,19 @@ main(int argc, char ** argv)
   command_t cmd;
   int i;
 
-  /* Input sanitation */
-  if (argc != 2) {
-    fprintf(stderr, "USAGE: %s port_num\n", argv[0]);
+  /* Input sanitation (in batch mode, requests may overlap) */
+  while ((i = getopt(argc, argv, "b")) != -1) {
+    if (i == 'b') {
+      session_data.batch = 1;
+    } else {
+      argc = 0;
+    }
+  }
+  if (argc != optind + 1) {
+    fprintf(stderr, "USAGE: %s [-b] port_num\n", argv[0]);
     return EXIT_FAILURE;
   }
+  argv += optind - 1;
 
   /* Crypto initialization */
   if (init_crypto(old_shmid(&i))) {
@@ -469,7 +875,8 @@ main(int argc, char ** argv)
     return EXIT_FAILURE;
   }
 
-  /* Socket initialization */
+  /* Socket initialization (the port is kept, should we reconnect) */
+  session_data.port = argv[1];
   if ((session_data.sock = init_client_socket(argv[1])) < 0) {
     fprintf(stderr, "FATAL: unable to connect to server\n");
     shutdown_crypto(old_shmid(&i));
@@ -500,6 +907,7 @@ main(int argc, char ** argv)
 
   /* Issue an interactive prompt, terminate only on failure */
   while (!session_data.caught_signal && (in = readline(SHELL_PROMPT))) {
+    ++session_data.line;
     /* Skip prefix whitespace */
     for (i = 0; in[i] == ' '; ++i);
     /* Ignore empty commands */
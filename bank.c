@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <getopt.h>
 #include <unistd.h>
 
 /* Readline includes */
@@ -34,33 +35,66 @@
 /* Local includes */
 #define USE_BALANCE
 #define USE_DEPOSIT
+#define USE_STATS
 #define HANDLE_LOGIN
 #define HANDLE_BALANCE
 #define HANDLE_WITHDRAW
 #define HANDLE_LOGOUT
 #define HANDLE_TRANSFER
+#define HANDLE_TICKET
 #include "banking_commands.h"
 #include "banking_constants.h"
 #include "crypto_utils.h"
 #include "db_utils.h"
+#include "event_utils.h"
+#include "lock_utils.h"
+#include "pool_utils.h"
 #include "socket_utils.h"
 
-struct thread_data_t {
-  pthread_t id;
-  int sock;
+/*! \brief Where a client is in the conversation, i.e. what comes next */
+enum client_state_t {
+  CLIENT_HELLO,   /* A "hello" under the default key */
+  CLIENT_TICKET,  /* The rest of a ticket, to resume (see handle_ticket) */
+  CLIENT_AUTH,    /* An authentication request */
+  CLIENT_COMMAND, /* A command, dispatched by fetch_handle */
+  CLIENT_RESUME,  /* The next step of a multi-message handler */
+  CLIENT_CLOSING  /* Nothing, replies are drained then we disconnect */
+};
+
+struct client_data_t {
+  struct event_source_t source;
+  unsigned long id;
+  enum client_state_t state;
+  int (*resume)(struct client_data_t *);
+  int rekeyed; /* The key changed under the client (see handle_stream) */
   struct credential_t credentials;
   struct buffet_t buffet;
-  struct sigaction * signal_action;
-  volatile int caught_signal;
+  struct db_handle_t * db_conn; /* Belongs to the worker serving us */
+  size_t received, replied, queued, sent;
+  unsigned char inbox[MAX_PENDING_FRAMES * MAX_FRAME_LENGTH];
+  char replies[MAX_PENDING_FRAMES][MAX_COMMAND_LENGTH];
+  size_t lengths[MAX_PENDING_FRAMES];
+  uint32_t requests[MAX_PENDING_FRAMES], request;
+  unsigned char outbox[MAX_PENDING_FRAMES * MAX_FRAME_LENGTH];
+  char pending[MAX_COMMAND_LENGTH];
+  size_t pendinglength;
   struct sockaddr_storage remote_addr;
   socklen_t remote_addr_len;
+  struct client_data_t * prev, * next;
 };
 
 struct server_session_data_t {
-  int sock;
-  sqlite3 * db_conn;
-  pthread_mutex_t * accept_mutex, * keystore_mutex;
-  struct thread_data_t thread_data[MAX_CONNECTIONS];
+  struct event_source_t listeners[MAX_LISTENERS];
+  int listener_count;
+  struct event_loop_t loop;
+  struct db_pool_t db_pool;
+  struct db_writer_t writer;
+  struct lock_table_t account_locks;
+  pthread_mutex_t clients_mutex;
+  struct client_data_t * clients;
+  unsigned long client_count, client_serial;
+  pthread_t dispatcher;
+  struct worker_pool_t workers;
   struct sigaction signal_action;
   volatile int caught_signal;
 } session_data;
@@ -95,7 +129,8 @@ balance_command(char * args)
   #endif
 
   /* Prepare the statement and run the query */
-  if (do_lookup(session_data.db_conn, &residue, username, len, &balance)) {
+  if (do_lookup(&session_data.db_pool.admin, &residue,
+                username, len, &balance)) {
     fprintf(stderr, "ERROR: no account found for '%s'\n", username);
   } else {
     printf("%s's balance is $%li\n", username, balance);
@@ -145,11 +180,12 @@ deposit_command(char * args)
     return BANKING_SUCCESS;
   }
 
-  /* Prepare and run actual queries */
-  if (do_lookup(session_data.db_conn, &residue,
+  /* Prepare and run actual queries, as one step for this account */
+  i = lock_account(&session_data.account_locks, username, len);
+  if (do_lookup(&session_data.db_pool.admin, &residue,
                 username, len, &balance)) {
     fprintf(stderr, "ERROR: no account found for '%s'\n", username);
-  } else if (do_update(session_data.db_conn, &residue,
+  } else if (do_update(&session_data.db_pool.admin, &residue,
                        username, len, balance + amount)) {
     fprintf(stderr,
             "ERROR: unable to complete request on ('%s', %li)\n",
@@ -158,6 +194,7 @@ deposit_command(char * args)
     printf("A transaction of $%li brings %s's balance from $%li to $%li\n",
            amount, username, balance, balance + amount);
   }
+  unlock_stripe(&session_data.account_locks, i);
   #ifndef NDEBUG
   if (*residue != '\0') {
     fprintf(stderr, "WARNING: ignoring '%s' (query residue)\n", residue);
@@ -168,46 +205,136 @@ deposit_command(char * args)
 }
 #endif /* USE_DEPOSIT */
 
+#ifdef USE_STATS
+int
+stats_command(char * args)
+{
+  #ifndef NDEBUG
+  if (*args != '\0') {
+    fprintf(stderr, "WARNING: ignoring '%s' (argument residue)\n", args);
+  }
+  #endif
+
+  print_lock_stats(&session_data.account_locks, stdout, STATS_STRIPES);
+  return BANKING_SUCCESS;
+}
+#endif /* USE_STATS */
+
 /* HANDLERS **************************************************************/
 
-#ifdef HANDLE_LOGIN
+/*! \brief Whether the outbox has room for count more replies */
+inline int
+reply_room(struct client_data_t * datum, size_t count) {
+  return datum->queued + (datum->replied + count) * MAX_FRAME_LENGTH
+      <= sizeof(datum->outbox);
+}
+
+/*! \brief Encrypt every pending session reply into the outbox, at once
+ *
+ *  This must happen before the session key changes (see mix_client), as
+ *  well as before anything else is queued or sent.
+ */
 int
-handle_login_command(struct thread_data_t * datum, char * args)
+seal_replies(struct client_data_t * datum)
 {
-  size_t i, len;
-  char buffer[MAX_COMMAND_LENGTH];
+  size_t len;
 
-  /* The login argument takes one argument */
-  #ifndef NDEBUG
-  if (*args == '\0') {
-    fprintf(stderr,
-            "[thread %lu] WARNING: [%s] arguments empty\n",
-            datum->id, "login");
-  } else {
+  if (!datum->replied) {
+    return BANKING_SUCCESS;
+  }
+  len = encrypt_frames(&datum->credentials, datum->replies[0],
+                       datum->lengths, datum->requests,
+                       datum->outbox + datum->queued,
+                       datum->replied);
+  wipe_bytes(datum->replies, datum->replied * MAX_COMMAND_LENGTH);
+  datum->replied = 0;
+  if (!len) {
     fprintf(stderr,
-            "[thread %lu] INFO: [%s] '%s' (arguments)\n",
-            datum->id, "login", args);
+            "[client %lu] ERROR: unable to encrypt replies\n",
+            datum->id);
+    return BANKING_FAILURE;
   }
-  #endif
-  /* TODO verify they're an actual user of the system */
+  datum->queued += len;
+  return BANKING_SUCCESS;
+}
 
-  /* Modify the key using bits from the username */
-  len = strnlen(args, MAX_COMMAND_LENGTH);
-  for (i = 0; i < AUTH_KEY_LENGTH; ++i) {
-    datum->credentials.key[i] ^= args[i % len];
+/*! \brief Seal replies under the current key, then mix bytes into it */
+inline int
+mix_client(struct client_data_t * datum, const char * bytes, size_t len) {
+  seal_replies(datum);
+  return mix_credentials(&datum->credentials, bytes, len);
+}
+
+/*! \brief Queue the plaintext buffer for encryption and delivery
+ *
+ *  Session replies are held until a batch of them may be encrypted at
+ *  once (see seal_replies); others are encrypted right away. Only the
+ *  first plength bytes of a session reply (all, if zero) need be sent,
+ *  and each names the request being handled (see handle_stream).
+ *
+ *  \param credentials The session to encrypt for (if NULL, the default key)
+ */
+int
+queue_reply(struct client_data_t * datum, struct credential_t * credentials)
+{
+  if (!reply_room(datum, 1)) {
+    fprintf(stderr,
+            "[client %lu] ERROR: too many replies pending\n",
+            datum->id);
+    return BANKING_FAILURE;
+  }
+  if (credentials) {
+    datum->lengths[datum->replied] = datum->buffet.plength;
+    datum->requests[datum->replied] = datum->request;
+    memcpy(datum->replies[datum->replied++],
+           datum->buffet.pbuffer, MAX_COMMAND_LENGTH);
+    return BANKING_SUCCESS;
   }
-  /* Turn around the message */
-  for (i = 0; i < MAX_COMMAND_LENGTH; ++i) {
-    datum->buffet.pbuffer[i] =
-     datum->buffet.tbuffer[MAX_COMMAND_LENGTH - 1 - i];
+  if (seal_replies(datum)
+   || encrypt_message(&datum->buffet, keystore.key)) {
+    return BANKING_FAILURE;
   }
-  /* Echo this message with the modified key */
-  encrypt_message(&datum->buffet, datum->credentials.key);
-  send_message(&datum->buffet, datum->sock);
+  memcpy(datum->outbox + datum->queued,
+         datum->buffet.cbuffer, datum->buffet.framelength);
+  datum->queued += datum->buffet.framelength;
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Queue a "mumble" (nonce), the reply to anything malformed */
+inline int
+queue_mumble(struct client_data_t * datum,
+             struct credential_t * credentials) {
+  fill_nonce(datum->buffet.pbuffer, MAX_COMMAND_LENGTH);
+  datum->buffet.plength = 0;
+  return queue_reply(datum, credentials);
+}
+
+/*! \brief Turn around the received message (as much as arrived) and echo
+ *         it
+ */
+int
+handle_turnaround(struct client_data_t * datum)
+{
+  size_t i, len;
+  len = datum->buffet.tlength ? datum->buffet.tlength : MAX_COMMAND_LENGTH;
+  for (i = 0; i < len; ++i) {
+    datum->buffet.pbuffer[i] = datum->buffet.tbuffer[len - 1 - i];
+  }
+  datum->buffet.plength = len;
+  return queue_reply(datum, &datum->credentials);
+}
+
+#ifdef HANDLE_LOGIN
+int
+handle_login_pin(struct client_data_t * datum)
+{
+  size_t i, len;
+  char * args, buffer[MAX_COMMAND_LENGTH];
+
+  /* The username was saved by handle_login_command */
+  args = datum->pending;
+  len = datum->pendinglength;
 
-  /* Receive the PIN */
-  recv_message(&datum->buffet, datum->sock);
-  decrypt_message(&datum->buffet, datum->credentials.key);
   /* Copy the args backward TODO better auth, use pin as salt */
   memset(buffer, '\0', MAX_COMMAND_LENGTH);
   for (i = 0; i < len; ++i) {
@@ -216,12 +343,11 @@ handle_login_command(struct thread_data_t * datum, char * args)
 
   /* Check the buffer matches the args */
   if (strncmp(buffer, datum->buffet.tbuffer, len)
-   || do_lookup(session_data.db_conn, NULL, args, len, NULL)) {
+   || do_lookup(datum->db_conn, NULL, args, len, NULL)) {
     snprintf(buffer, MAX_COMMAND_LENGTH, "LOGIN ERROR");
     /* Remove the previously added bits */
-    for (i = 0; i < AUTH_KEY_LENGTH; ++i) {
-      datum->credentials.key[i] ^= args[i % len];
-    }
+    mix_client(datum, args, len);
+    datum->rekeyed = 1;
   } else {
     snprintf(buffer, MAX_COMMAND_LENGTH, "%s, %s!", AUTH_LOGIN_MSG, args);
     /* We have now authenticated the user */
@@ -229,123 +355,180 @@ handle_login_command(struct thread_data_t * datum, char * args)
     strncpy(datum->credentials.username, args, len);
     datum->credentials.userlength = len;
   }
+  memset(datum->pending, '\0', MAX_COMMAND_LENGTH);
+  datum->pendinglength = 0;
   salt_and_pepper(buffer, NULL, &datum->buffet);
-  encrypt_message(&datum->buffet, datum->credentials.key);
-  send_message(&datum->buffet, datum->sock);
-
-  /* Catch authentication check */
-  recv_message(&datum->buffet, datum->sock);
-  decrypt_message(&datum->buffet, datum->credentials.key);
-  /* Turn around the message */
-  for (i = 0; i < MAX_COMMAND_LENGTH; ++i) {
-    datum->buffet.pbuffer[i] =
-     datum->buffet.tbuffer[MAX_COMMAND_LENGTH - 1 - i];
-  }
-  encrypt_message(&datum->buffet, datum->credentials.key);
-  send_message(&datum->buffet, datum->sock);
 
-  return BANKING_SUCCESS;
+  /* Catch the authentication check that follows */
+  datum->state = CLIENT_RESUME;
+  datum->resume = &handle_turnaround;
+  return queue_reply(datum, &datum->credentials);
 }
-#endif /* HANDLE_LOGIN */
 
-#ifdef HANDLE_BALANCE
 int
-handle_balance_command(struct thread_data_t * datum, char * args)
+handle_login_command(struct client_data_t * datum, char * args)
 {
-  long int balance;
-  char buffer[MAX_COMMAND_LENGTH];
+  size_t len;
 
-  /* Balance command takes no arguments */
+  /* The login argument takes one argument */
   #ifndef NDEBUG
-  if (*args != '\0') {
+  if (*args == '\0') {
     fprintf(stderr,
-            "[thread %lu] WARNING: ignoring '%s' (argument residue)\n",
-            datum->id, args);
+            "[client %lu] WARNING: [%s] arguments empty\n",
+            datum->id, "login");
+  } else {
+    fprintf(stderr,
+            "[client %lu] INFO: [%s] '%s' (arguments)\n",
+            datum->id, "login", args);
   }
   #endif
+  /* TODO verify they're an actual user of the system */
 
-  /* Formulate a response */
-  memset(buffer, '\0', MAX_COMMAND_LENGTH);
+  /* Modify the key using bits from the username */
+  len = strnlen(args, MAX_COMMAND_LENGTH);
+  mix_client(datum, args, len);
+  /* Hold on to the username until the PIN arrives */
+  memset(datum->pending, '\0', MAX_COMMAND_LENGTH);
+  strncpy(datum->pending, args, len);
+  datum->pendinglength = len;
+
+  /* Echo this message with the modified key, then await the PIN */
+  datum->state = CLIENT_RESUME;
+  datum->resume = &handle_login_pin;
+  return handle_turnaround(datum);
+}
+#endif /* HANDLE_LOGIN */
+
+/*! \brief Carry out a request, and answer it in the form it came
+ *
+ *  Each request (binary or text) is carried out by its operation, which
+ *  fills in how it went. Binary requests are answered in kind, and text
+ *  (from an ATM that predates FRAME_VERSION_BINARY) with the text of the
+ *  same reply (see render_message).
+ */
+int
+answer_request(struct client_data_t *, const struct message_t *, int);
+
+typedef void (*operation_t)(struct client_data_t *,
+                            const struct message_t *, struct message_t *);
+
+#ifdef HANDLE_BALANCE
+void
+balance_operation(struct client_data_t * datum,
+                  const struct message_t * request,
+                  struct message_t * reply)
+{
+  long int balance;
+
+  (void)(request);
   /* If we have a username, try to do a lookup */
   if (datum->credentials.userlength
-   && do_lookup(session_data.db_conn, NULL,
+   && do_lookup(datum->db_conn, NULL,
                 datum->credentials.username,
                 datum->credentials.userlength,
                 &balance) == BANKING_SUCCESS) {
-    snprintf(buffer, MAX_COMMAND_LENGTH,
-             "%s, your balance is $%li.",
-             datum->credentials.username, balance);
+    reply->amount = balance;
+    reply->name = datum->credentials.username;
+    reply->namelength = datum->credentials.userlength;
   } else {
-    snprintf(buffer, MAX_COMMAND_LENGTH, "BALANCE ERROR");
+    reply->status = STATUS_ERROR;
   }
-  /* Send the results */
-  salt_and_pepper(buffer, NULL, &datum->buffet);
-  encrypt_message(&datum->buffet, datum->credentials.key);
-  send_message(&datum->buffet, datum->sock);
-  return BANKING_SUCCESS;
+}
+
+int
+handle_balance_command(struct client_data_t * datum, char * args)
+{
+  struct message_t request;
+
+  /* Balance command takes no arguments */
+  #ifndef NDEBUG
+  if (*args != '\0') {
+    fprintf(stderr,
+            "[client %lu] WARNING: ignoring '%s' (argument residue)\n",
+            datum->id, args);
+  }
+  #endif
+
+  memset(&request, '\0', sizeof(struct message_t));
+  request.opcode = OP_BALANCE;
+  return answer_request(datum, &request, 0);
 }
 #endif /* HANDLE_BALANCE */
 
 #ifdef HANDLE_WITHDRAW
-int
-handle_withdraw_command(struct thread_data_t * datum, char * args)
+void
+withdraw_operation(struct client_data_t * datum,
+                   const struct message_t * request,
+                   struct message_t * reply)
 {
+  size_t stripe;
   long balance, amount;
-  char buffer[MAX_COMMAND_LENGTH];
+
+  if (request->amount <= 0 || request->amount > MAX_TRANSACTION) {
+    reply->status = STATUS_INVALID;
+    return;
+  }
+  if (!datum->credentials.userlength) {
+    reply->status = STATUS_ERROR;
+    return;
+  }
+  amount = (long)(request->amount);
+  stripe = lock_account(&session_data.account_locks,
+                        datum->credentials.username,
+                        datum->credentials.userlength);
+  if (do_withdraw(&session_data.writer,
+                  datum->credentials.username,
+                  datum->credentials.userlength,
+                  amount) != BANKING_SUCCESS) {
+    if (do_lookup(datum->db_conn, NULL,
+                  datum->credentials.username,
+                  datum->credentials.userlength,
+                  &balance) == BANKING_SUCCESS) {
+      /* Only a declined withdrawal needs to know why */
+      reply->status = (balance < amount) ? STATUS_INSUFFICIENT
+                                         : STATUS_DECLINED;
+    } else {
+      reply->status = STATUS_ERROR;
+    }
+  }
+  unlock_stripe(&session_data.account_locks, stripe);
+}
+
+int
+handle_withdraw_command(struct client_data_t * datum, char * args)
+{
+  struct message_t request;
 
   #ifndef NDEBUG
   if (*args == '\0') {
     fprintf(stderr,
-            "[thread %lu] WARNING: [%s] arguments empty\n",
+            "[client %lu] WARNING: [%s] arguments empty\n",
             datum->id, "withdraw");
   } else {
     fprintf(stderr,
-            "[thread %lu] INFO: [%s] '%s' (arguments)\n",
+            "[client %lu] INFO: [%s] '%s' (arguments)\n",
             datum->id, "withdraw", args);
   }
   #endif
-  amount = strtol(args, &args, 10);
-
-  if (amount <= 0 || amount > MAX_TRANSACTION) {
-    snprintf(buffer, MAX_COMMAND_LENGTH, "Invalid withdrawal amount.");
-  } else if (datum->credentials.userlength
-   && do_lookup(session_data.db_conn, NULL,
-                datum->credentials.username,
-                datum->credentials.userlength,
-                &balance) == BANKING_SUCCESS) {
-    if (balance < amount) {
-      snprintf(buffer, MAX_COMMAND_LENGTH, "Insufficient funds.");
-    } else if (do_update(session_data.db_conn, NULL,
-               datum->credentials.username,
-               datum->credentials.userlength,
-               balance - amount)) {
-      snprintf(buffer, MAX_COMMAND_LENGTH, "Cannot complete withdrawal.");
-    } else {
-      snprintf(buffer, MAX_COMMAND_LENGTH, "Withdrew $%li", amount);
-    }
-  } else {
-    snprintf(buffer, MAX_COMMAND_LENGTH, "WITHDRAW ERROR");
-  }
-  salt_and_pepper(buffer, NULL, &datum->buffet);
-  encrypt_message(&datum->buffet, datum->credentials.key);
-  send_message(&datum->buffet, datum->sock);
-
-  return BANKING_SUCCESS;
+  memset(&request, '\0', sizeof(struct message_t));
+  request.opcode = OP_WITHDRAW;
+  request.amount = strtol(args, &args, 10);
+  return answer_request(datum, &request, 0);
 }
 #endif /* HANDLE_WITHDRAW */
 
 #ifdef HANDLE_LOGOUT
 int
-handle_logout_command(struct thread_data_t * datum, char * args)
+handle_logout_command(struct client_data_t * datum, char * args)
 {
-  int i, len;
+  int status;
   char buffer[MAX_COMMAND_LENGTH];
 
   /* Logout command takes no arguments */
   #ifndef NDEBUG
   if (*args != '\0') {
     fprintf(stderr,
-            "[thread %lu] WARNING: ignoring '%s' (argument residue)\n",
+            "[client %lu] WARNING: ignoring '%s' (argument residue)\n",
             datum->id, args);
   }
   #endif
@@ -359,92 +542,238 @@ handle_logout_command(struct thread_data_t * datum, char * args)
     snprintf(buffer, MAX_COMMAND_LENGTH, "LOGOUT ERROR");
   }
   salt_and_pepper(buffer, NULL, &datum->buffet);
-  encrypt_message(&datum->buffet, datum->credentials.key);
+  status = queue_reply(datum, &datum->credentials);
   /* Clear the credential bits from the key */
   if (datum->credentials.userlength) {
-    len = datum->credentials.userlength;
-    for (i = 0; i < AUTH_KEY_LENGTH; ++i) {
-      datum->credentials.key[i] ^=
-       datum->credentials.username[i % len];
-    }
+    mix_client(datum, datum->credentials.username,
+               datum->credentials.userlength);
     memset(&datum->credentials.username, '\0', MAX_COMMAND_LENGTH);
     datum->credentials.userlength = 0;
+    datum->rekeyed = 1;
   }
-  send_message(&datum->buffet, datum->sock);
 
   /* Handle verification (should fail) */
-  recv_message(&datum->buffet, datum->sock);
-  decrypt_message(&datum->buffet, datum->credentials.key);
-  for (i = 0; i < MAX_COMMAND_LENGTH; ++i) {
-    datum->buffet.pbuffer[i] =
-     datum->buffet.tbuffer[MAX_COMMAND_LENGTH - 1 - i];
-  }
-  encrypt_message(&datum->buffet, datum->credentials.key);
-  send_message(&datum->buffet, datum->sock);
-
-  return BANKING_SUCCESS;
+  datum->state = CLIENT_RESUME;
+  datum->resume = &handle_turnaround;
+  return status;
 }
 #endif /* HANDLE_LOGOUT */
 
 #ifdef HANDLE_TRANSFER
-int
-handle_transfer_command(struct thread_data_t * datum, char * args)
+void
+transfer_operation(struct client_data_t * datum,
+                   const struct message_t * request,
+                   struct message_t * reply)
 {
+  size_t first, second;
   long amount, balance;
-  char * user, buffer[MAX_COMMAND_LENGTH];
+
+  if (request->amount <= 0 || request->amount > MAX_TRANSACTION) {
+    reply->status = STATUS_INVALID;
+    return;
+  }
+  if (!datum->credentials.userlength) {
+    reply->status = STATUS_ERROR;
+    return;
+  }
+  amount = (long)(request->amount);
+  lock_accounts(&session_data.account_locks,
+                datum->credentials.username,
+                datum->credentials.userlength,
+                request->name, request->namelength, &first, &second);
+  if (do_transfer(&session_data.writer,
+                  datum->credentials.username,
+                  datum->credentials.userlength,
+                  (char *)(request->name), request->namelength,
+                  amount) == BANKING_SUCCESS) {
+    reply->name = request->name;
+    reply->namelength = request->namelength;
+  } else if (do_lookup(datum->db_conn, NULL,
+                       datum->credentials.username,
+                       datum->credentials.userlength,
+                       &balance) == BANKING_SUCCESS) {
+    /* Only a declined transfer needs to know why */
+    reply->status = (balance < amount) ? STATUS_INSUFFICIENT
+                                       : STATUS_DECLINED;
+  } else {
+    reply->status = STATUS_ERROR;
+  }
+  unlock_accounts(&session_data.account_locks, first, second);
+}
+
+int
+handle_transfer_command(struct client_data_t * datum, char * args)
+{
+  struct message_t request;
 
   #ifndef NDEBUG
   if (*args == '\0') {
     fprintf(stderr,
-            "[thread %lu] WARNING: [%s] arguments empty\n",
+            "[client %lu] WARNING: [%s] arguments empty\n",
             datum->id, "transfer");
   } else {
     fprintf(stderr,
-            "[thread %lu] INFO: [%s] '%s' (arguments)\n",
+            "[client %lu] INFO: [%s] '%s' (arguments)\n",
             datum->id, "transfer", args);
   }
   #endif
-  amount = strtol(args, &args, 10);
-  user = ++args;
+  memset(&request, '\0', sizeof(struct message_t));
+  request.opcode = OP_TRANSFER;
+  request.amount = strtol(args, &args, 10);
+  /* The recipient follows a space (if anything follows at all) */
+  request.name = (*args == '\0') ? args : ++args;
+  request.namelength = strnlen(args, MAX_COMMAND_LENGTH);
+  return answer_request(datum, &request, 0);
+}
+#endif /* HANDLE_TRANSFER */
 
-  if (amount <= 0 || amount > MAX_TRANSACTION) {
-    snprintf(buffer, MAX_COMMAND_LENGTH, "Invalid transfer amount.");
-  } else if (datum->credentials.userlength
-   && do_lookup(session_data.db_conn, NULL,
-                datum->credentials.username,
-                datum->credentials.userlength,
-                &balance) == BANKING_SUCCESS) {
-    if (balance < amount) {
-      snprintf(buffer, MAX_COMMAND_LENGTH, "Insufficient funds.");
-    } else if (do_update(session_data.db_conn, NULL,
-               datum->credentials.username,
-               datum->credentials.userlength,
-               balance - amount)
-            || do_lookup(session_data.db_conn, NULL,
-               user, strnlen(user, MAX_COMMAND_LENGTH),
-               &balance)
-            || do_update(session_data.db_conn, NULL,
-               user, strnlen(user, MAX_COMMAND_LENGTH),
-               balance + amount)) {
-      /* TODO atomic operation? */
-      snprintf(buffer, MAX_COMMAND_LENGTH, "Cannot complete transfer.");
-    } else {
-      snprintf(buffer, MAX_COMMAND_LENGTH, "Transfered $%li to %s",
-                                           amount, user);
-    }
+/*! \brief The operation behind each opcode (if handled) */
+const operation_t operations[OP_COUNT] = {
+  #ifdef HANDLE_BALANCE
+  [OP_BALANCE] = &balance_operation,
+  #endif
+  #ifdef HANDLE_WITHDRAW
+  [OP_WITHDRAW] = &withdraw_operation,
+  #endif
+  #ifdef HANDLE_TRANSFER
+  [OP_TRANSFER] = &transfer_operation,
+  #endif
+  [OP_NONE] = NULL
+};
+
+int
+answer_request(struct client_data_t * datum,
+               const struct message_t * request, int binary)
+{
+  struct message_t reply;
+  char buffer[MAX_COMMAND_LENGTH];
+
+  /* Replies repeat the opcode and amount, and say how it went */
+  memset(&reply, '\0', sizeof(struct message_t));
+  reply.opcode = request->opcode;
+  reply.amount = request->amount;
+  if (operations[request->opcode]) {
+    operations[request->opcode](datum, request, &reply);
   } else {
-    snprintf(buffer, MAX_COMMAND_LENGTH, "TRANSFER ERROR");
+    reply.status = STATUS_ERROR;
   }
-  salt_and_pepper(buffer, NULL, &datum->buffet);
-  encrypt_message(&datum->buffet, datum->credentials.key);
-  send_message(&datum->buffet, datum->sock);
+  if (!binary) {
+    memset(buffer, '\0', MAX_COMMAND_LENGTH);
+    render_message(buffer, MAX_COMMAND_LENGTH, &reply);
+    salt_and_pepper(buffer, NULL, &datum->buffet);
+  } else if (pepper_message(&reply, &datum->buffet)) {
+    return queue_mumble(datum, &datum->credentials);
+  }
+  return queue_reply(datum, &datum->credentials);
+}
 
+#ifdef HANDLE_TICKET
+int
+handle_ticket_command(struct client_data_t * datum, char * args)
+{
+  int status;
+  char second[MAX_COMMAND_LENGTH];
+  unsigned char ticket[AUTH_TICKET_LENGTH];
+
+  /* Ticket command takes no arguments */
+  #ifndef NDEBUG
+  if (*args != '\0') {
+    fprintf(stderr,
+            "[client %lu] WARNING: ignoring '%s' (argument residue)\n",
+            datum->id, args);
+  }
+  #endif
+
+  /* Only those logged in get one (see seal_ticket) */
+  lock_keystore();
+  status = seal_ticket(ticket, &datum->credentials);
+  unlock_keystore();
+
+  /* Either way, the reply is two messages (the second is nonce on error) */
+  fill_nonce(second, MAX_COMMAND_LENGTH);
+  if (status == BANKING_SUCCESS) {
+    fill_nonce(datum->buffet.pbuffer, MAX_COMMAND_LENGTH);
+    memcpy(datum->buffet.pbuffer, AUTH_TICKET_MSG, sizeof(AUTH_TICKET_MSG));
+    split_ticket(ticket, datum->buffet.pbuffer, second,
+                 sizeof(AUTH_TICKET_MSG));
+    datum->buffet.plength = 0;
+    #ifndef NDEBUG
+    fprintf(stderr,
+            "[client %lu] INFO: issued ticket to '%s'\n",
+            datum->id, datum->credentials.username);
+    #endif
+  } else {
+    salt_and_pepper("TICKET ERROR", NULL, &datum->buffet);
+  }
+  status = queue_reply(datum, &datum->credentials);
+  memcpy(datum->buffet.pbuffer, second, MAX_COMMAND_LENGTH);
+  datum->buffet.plength = 0;
+  wipe_bytes(ticket, AUTH_TICKET_LENGTH);
+  wipe_bytes(second, MAX_COMMAND_LENGTH);
+  return status ? status : queue_reply(datum, &datum->credentials);
+}
+#endif /* HANDLE_TICKET */
+
+/* LISTENERS *************************************************************/
+
+void
+destroy_listeners()
+{
+  int i;
+  for (i = 0; i < session_data.listener_count; ++i) {
+    destroy_socket(session_data.listeners[i].sock);
+  }
+  session_data.listener_count = 0;
+}
+
+/*! \brief Open count listening sockets on the same port
+ *
+ *  A single listener is opened exclusively. Otherwise, each is opened with
+ *  SO_REUSEPORT, so the kernel spreads incoming connections across them,
+ *  and every listener may be accepted from by a different worker at once.
+ */
+int
+init_listeners(const char * port, int backlog, int count)
+{
+  int sock;
+  struct event_source_t * listener;
+
+  session_data.listener_count = 0;
+  while (session_data.listener_count < count) {
+    if ((sock = init_server_socket(port, backlog, count > 1)) < 0) {
+      destroy_listeners();
+      return BANKING_FAILURE;
+    }
+    listener = &session_data.listeners[session_data.listener_count++];
+    listener->sock = sock;
+    listener->type = EVENT_LISTENER;
+    if (set_nonblocking(sock)) {
+      destroy_listeners();
+      return BANKING_FAILURE;
+    }
+  }
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Begin accepting on every listener */
+int
+watch_listeners()
+{
+  int i;
+  for (i = 0; i < session_data.listener_count; ++i) {
+    if (watch_source(&session_data.loop,
+                     &session_data.listeners[i], EPOLLIN)) {
+      return BANKING_FAILURE;
+    }
+  }
   return BANKING_SUCCESS;
 }
-#endif /* HANDLE_TRANSFER */
 
 /* SIGNAL HANDLERS *******************************************************/
 
+void
+disconnect_client(struct client_data_t *);
+
 void
 handle_signal(int signum)
 {
@@ -458,41 +787,40 @@ handle_signal(int signum)
   /* Perform a graceful shutdown of the system */
   session_data.caught_signal = signum;
 
-  /* Send SIGTERM to every worker */
-  for (i = 0; i < MAX_CONNECTIONS; ++i) {
-    if (session_data.thread_data[i].id != (pthread_t)(BANKING_FAILURE)) {
-      #ifndef NDEBUG
-      fprintf(stderr, "INFO: sending kill signal to worker thread\n");
-      #endif
-      pthread_kill(session_data.thread_data[i].id, SIGUSR1);
-    }
-  }
+  /* Release the dispatcher and every worker */
+  #ifndef NDEBUG
+  fprintf(stderr, "INFO: stopping event loop\n");
+  #endif
+  stop_event_loop(&session_data.loop);
 
   /* Now collect them */
-  for (i = 0; i < MAX_CONNECTIONS; ++i) {
-    if (session_data.thread_data[i].id != (pthread_t)(BANKING_FAILURE)) {
-      if (pthread_join(session_data.thread_data[i].id, NULL)) {
-        session_data.thread_data[i].id = (pthread_t)(BANKING_FAILURE);
-        fprintf(stderr, "ERROR: failed to collect worker thread\n");
-      } else {
-        session_data.thread_data[i].id = (pthread_t)(BANKING_SUCCESS);
-        #ifndef NDEBUG
-        fprintf(stderr, "INFO: collected worker thread\n");
-        #endif
-      }
+  if (session_data.dispatcher != (pthread_t)(BANKING_FAILURE)) {
+    if (pthread_join(session_data.dispatcher, NULL)) {
+      fprintf(stderr, "ERROR: failed to collect dispatcher thread\n");
     }
+    session_data.dispatcher = (pthread_t)(BANKING_FAILURE);
+  }
+  destroy_worker_pool(&session_data.workers);
+  /* Which leaves nobody to submit balance updates */
+  destroy_db_writer(&session_data.writer);
+  destroy_lock_table(&session_data.account_locks);
+
+  /* With no workers left, clients may be dropped without locking */
+  while (session_data.clients) {
+    disconnect_client(session_data.clients);
   }
 
   /* Do remaining housekeeping */
-  gcry_pthread_mutex_destroy((void **)(&session_data.accept_mutex));
-  gcry_pthread_mutex_destroy((void **)(&session_data.keystore_mutex));
-  destroy_socket(session_data.sock);
+  destroy_event_loop(&session_data.loop);
+  pthread_mutex_destroy(&session_data.clients_mutex);
+  destroy_listeners();
+  release_tickets();
   /* TODO remove shared memory code */
   shutdown_crypto(old_shmid(&i));
   if (shmctl(i, IPC_RMID, NULL)) {
     fprintf(stderr, "WARNING: unable to remove shared memory segment\n");
   }
-  destroy_db(BANKING_DB_FILE, session_data.db_conn);
+  destroy_db_pool(BANKING_DB_FILE, &session_data.db_pool);
 
   /* Re-raise proper signals */
   if (signum == SIGINT || signum == SIGTERM) {
@@ -520,172 +848,625 @@ handle_interruption(int signum)
 
 /* CLIENT HANDLERS *******************************************************/
 
-/*! \brief Handle a message stream from a client */
-int
-handle_stream(struct thread_data_t * datum) {
-  int i;
-  handle_t hdl;
-  char msg[MAX_COMMAND_LENGTH], * args;
+/*! \brief Called by the keystore (locked) once a session key expires
+ *
+ *  Clients are never freed before their key is revoked, so datum is live.
+ *  Shutting down the socket hands the client to a worker, which will see
+ *  it hang up and disconnect it (so the client must start a new session).
+ */
+void
+handle_expiry(void * context)
+{
+  struct client_data_t * datum = context;
+  #ifndef NDEBUG
+  fprintf(stderr, "[client %lu] INFO: session key expired\n", datum->id);
+  #endif
+  shutdown(datum->source.sock, SHUT_RDWR);
+}
 
-  /* The initial message is always an authentication request */
-  recv_message(&datum->buffet, datum->sock);
-  decrypt_message(&datum->buffet, datum->credentials.key);
+/*! \brief Handle the "hello" that opens every connection */
+int
+handle_hello(struct client_data_t * datum)
+{
+  /* Decrypt it with the default key */
+  if (decrypt_message(&datum->buffet, keystore.key)) {
+    return BANKING_FAILURE;
+  }
+  /* A client holding a ticket resumes instead (the rest is to follow) */
+  if (tickets.key && !strncmp(datum->buffet.tbuffer,
+                              AUTH_RESUME_MSG, sizeof(AUTH_RESUME_MSG))) {
+    memcpy(datum->pending, datum->buffet.tbuffer, MAX_COMMAND_LENGTH);
+    datum->state = CLIENT_TICKET;
+    return BANKING_SUCCESS;
+  }
+  /* Verify it is an authentication request */
   if (strncmp(datum->buffet.tbuffer,
               AUTH_CHECK_MSG, sizeof(AUTH_CHECK_MSG))) {
-    #ifndef NDEBUG
-    fprintf(stderr,
-            "[thread %lu] INFO: malformed authentication message\n",
-            datum->id);
-    #endif
-    /* Respond with a "mumble" (nonce) */
-    gcry_create_nonce(datum->buffet.pbuffer, MAX_COMMAND_LENGTH);
-    encrypt_message(&datum->buffet, datum->credentials.key);
-    send_message(&datum->buffet, datum->sock);
+    /* Respond with nonce (misdirection) */
+    queue_mumble(datum, NULL);
     return BANKING_FAILURE;
   }
-  /* Turn around the buffer and toss it back */
-  for (i = 0; i < MAX_COMMAND_LENGTH; ++i) {
-    datum->buffet.pbuffer[i] =
-     datum->buffet.tbuffer[MAX_COMMAND_LENGTH - 1 - i];
-  }
-  encrypt_message(&datum->buffet, datum->credentials.key);
-  send_message(&datum->buffet, datum->sock);
-  clear_buffet(&datum->buffet);
+  /* Settle on a cipher suite (older ATMs offer none, so get the legacy) */
+  datum->credentials.suite =
+   accept_suite(datum->buffet.tbuffer + sizeof(AUTH_CHECK_MSG));
+  datum->credentials.role = ROLE_BANK;
+  /* Likewise, fixed frames unless the ATM offers a version we speak */
+  datum->credentials.framing =
+   accept_framing(hello_framing(datum->buffet.tbuffer));
   #ifndef NDEBUG
-  fprintf(stderr,
-          "[thread %lu] INFO: authentication successful\n",
-          datum->id);
+  fprintf(stderr, "[client %lu] INFO: using cipher suite %s (%s frames)\n",
+          datum->id, suite_name(datum->credentials.suite),
+          datum->credentials.framing ? "variable" : "fixed");
   #endif
 
-  /* Read the actual command */
-  recv_message(&datum->buffet, datum->sock);
-  decrypt_message(&datum->buffet, datum->credentials.key);
-  /* Copy the command into a buffer so more can be received */
-  strncpy(msg, datum->buffet.tbuffer, MAX_COMMAND_LENGTH);
+  /* Request a session key (the keystore does its own locking, and most
+   * often has one generated already) */
   #ifndef NDEBUG
-  /* Local echo for all received messages */
-  fprintf(stderr,
-          "[thread %lu] INFO: worker received message:\n",
-          datum->id);
-  hexdump(stderr, (unsigned char *)(msg), MAX_COMMAND_LENGTH);
+  print_keystore(stderr, "before request");
   #endif
-  
-  /* Disconnect from any client that issues malformed commands */
-  if (fetch_handle(msg, &hdl, &args)) {
-    /* Respond with a "mumble" (nonce) */
-    gcry_create_nonce(datum->buffet.pbuffer, MAX_COMMAND_LENGTH);
-    encrypt_message(&datum->buffet, datum->credentials.key);
-    send_message(&datum->buffet, datum->sock);
-    clear_buffet(&datum->buffet);
+  request_key(&datum->credentials.key);
+  watch_key(&datum->credentials.key, &handle_expiry, datum);
+  #ifndef NDEBUG
+  print_keystore(stderr, "after request");
+  #endif
+  /* Key setup happens once here, and again only if the key changes */
+  lock_keystore();
+  if (setkey_credentials(&datum->credentials)) {
+    unlock_keystore();
+    fprintf(stderr,
+            "[client %lu] ERROR: unable to key session cipher\n",
+            datum->id);
     return BANKING_FAILURE;
   }
-  /* We are signaled by failed handlers */
-  datum->caught_signal = hdl(datum, args);
-  clear_buffet(&datum->buffet);
-
+  /* Encrypted it using the default key */
+  pack_credentials(&datum->buffet, &datum->credentials);
+  unlock_keystore();
+  if (tickets.key) {
+    memcpy(ticket_offer(datum->buffet.pbuffer),
+           AUTH_TICKET_MSG, sizeof(AUTH_TICKET_MSG));
+  }
+  if (datum->credentials.framing) {
+    offer_framing(reply_framing(datum->buffet.pbuffer),
+                  datum->credentials.framing);
+  }
+  datum->state = CLIENT_AUTH;
+  if (queue_reply(datum, NULL)) {
+    return BANKING_FAILURE;
+  }
+  /* Every frame hereafter is under the suite (and framing) */
+  datum->buffet.framelength = frame_length(datum->credentials.suite);
+  datum->buffet.framing = datum->credentials.framing;
   return BANKING_SUCCESS;
 }
 
-void *
-handle_client(void * arg)
+/*! \brief Resume a session from the ticket begun at "hello"
+ *
+ *  The reply (under the default key) is AUTH_RESUME_MSG, then whether the
+ *  ticket was accepted, then our nonce, the suite and any framing. A
+ *  refused client is disconnected, so it may start over with a "hello".
+ */
+int
+handle_ticket(struct client_data_t * datum)
 {
-  struct thread_data_t * datum = (struct thread_data_t *)(arg);
-  /* Fetch the ID from the argument */
+  int status;
+  struct ticket_t contents;
+  unsigned char ticket[AUTH_TICKET_LENGTH], nonces[2 * AUTH_NONCE_LENGTH];
+  char * reply = datum->buffet.pbuffer + sizeof(AUTH_RESUME_MSG);
+
+  /* The first message (see handle_hello) held the marker and their nonce */
+  if (decrypt_message(&datum->buffet, keystore.key)) {
+    return BANKING_FAILURE;
+  }
+  join_ticket(ticket, datum->pending, datum->buffet.tbuffer,
+              sizeof(AUTH_RESUME_MSG) + AUTH_NONCE_LENGTH);
+  memcpy(nonces, datum->pending + sizeof(AUTH_RESUME_MSG),
+         AUTH_NONCE_LENGTH);
+  fill_nonce(nonces + AUTH_NONCE_LENGTH, AUTH_NONCE_LENGTH);
+  wipe_bytes(datum->pending, MAX_COMMAND_LENGTH);
+  clear_buffet(&datum->buffet);
+
+  /* The account may have gone since the ticket was issued */
+  status = (open_ticket(ticket, &contents)
+         || do_lookup(datum->db_conn, NULL, contents.username,
+                      contents.userlength, NULL))
+         ? BANKING_FAILURE : BANKING_SUCCESS;
+  if (status == BANKING_SUCCESS) {
+    datum->credentials.suite = contents.suite;
+    datum->credentials.framing = contents.framing;
+    datum->credentials.role = ROLE_BANK;
+    set_username(&datum->credentials, contents.username,
+                 contents.userlength);
+    if ((status = resume_credentials(&datum->credentials,
+                                     contents.secret, nonces))) {
+      fprintf(stderr,
+              "[client %lu] ERROR: unable to key session cipher\n",
+              datum->id);
+    } else {
+      watch_key(&datum->credentials.key, &handle_expiry, datum);
+    }
+  }
+  wipe_bytes(&contents, sizeof(struct ticket_t));
+  wipe_bytes(ticket, AUTH_TICKET_LENGTH);
   #ifndef NDEBUG
-  fprintf(stderr, "[thread %lu] INFO: worker started\n", datum->id);
+  fprintf(stderr, "[client %lu] INFO: ticket %s\n",
+          datum->id, status ? "refused" : "accepted");
   #endif
 
-  /* Worker thread signal handling is unique */
-  sigaction(SIGUSR1, datum->signal_action, NULL);
-  sigaction(SIGUSR2, datum->signal_action, NULL);
-
-  /* As long as possible, grab up whatever connection is available */
-  while (!session_data.caught_signal && !datum->caught_signal) {
-    /* Ensure only one worker accepts the next client */
-    gcry_pthread_mutex_lock((void **)(&session_data.accept_mutex));
-    datum->sock = accept(session_data.sock,
-                         (struct sockaddr *)(&datum->remote_addr),
-                         &datum->remote_addr_len);
-    gcry_pthread_mutex_unlock((void **)(&session_data.accept_mutex));
-    if (datum->sock >= 0) {
+  fill_nonce(datum->buffet.pbuffer, MAX_COMMAND_LENGTH);
+  memcpy(datum->buffet.pbuffer, AUTH_RESUME_MSG, sizeof(AUTH_RESUME_MSG));
+  reply[0] = (char)(status == BANKING_SUCCESS);
+  memcpy(reply + 1, nonces + AUTH_NONCE_LENGTH, AUTH_NONCE_LENGTH);
+  reply[1 + AUTH_NONCE_LENGTH] = (char)(datum->credentials.suite);
+  if (datum->credentials.framing) {
+    offer_framing(reply + 2 + AUTH_NONCE_LENGTH,
+                  datum->credentials.framing);
+  }
+  wipe_bytes(nonces, 2 * AUTH_NONCE_LENGTH);
+  if (queue_reply(datum, NULL) || status) {
+    return BANKING_FAILURE;
+  }
+  /* Like a "hello", this is followed by an authentication request */
+  datum->state = CLIENT_AUTH;
+  datum->buffet.framelength = frame_length(datum->credentials.suite);
+  datum->buffet.framing = datum->credentials.framing;
+  return BANKING_SUCCESS;
+}
+
+/*! \brief The length of the frame at offset in the inbox
+ *
+ *  \return 0 until the frame has arrived whole, or BANKING_FAILURE if its
+ *          header is malformed (see frame_extent)
+ */
+inline ssize_t
+inbox_frame(struct client_data_t * datum, size_t offset) {
+  ssize_t length = datum->buffet.framing
+                 ? frame_extent(datum->inbox + offset,
+                                datum->received - offset)
+                 : (ssize_t)(frame_bytes(&datum->buffet));
+  return (length > 0 && (size_t)(length) > datum->received - offset)
+         ? 0 : length;
+}
+
+/*! \brief Handle one message from a client, according to its state */
+int
+handle_stream(struct client_data_t * datum) {
+  int status;
+  handle_t hdl;
+  struct message_t request;
+  char msg[MAX_COMMAND_LENGTH], * args;
+
+  /* Frames that fail authentication (if the suite has tags) end things,
+   * save one: the probe that follows a re-key (say, at logout) is meant
+   * to fail, so there it reads as zeros (and fails the turnaround) */
+  if (decrypt_session(&datum->buffet, &datum->credentials)
+   && !(datum->rekeyed && datum->state == CLIENT_RESUME
+                       && datum->resume == &handle_turnaround)) {
+    fprintf(stderr,
+            "[client %lu] WARNING: frame failed authentication\n",
+            datum->id);
+    clear_buffet(&datum->buffet);
+    return BANKING_FAILURE;
+  }
+  datum->rekeyed = 0;
+  /* Every reply to this frame names it (see queue_reply) */
+  datum->request = datum->buffet.trequest;
+  switch (datum->state) {
+  case CLIENT_AUTH:
+    /* The initial message is an authentication request, unless requests
+     * prove themselves (then it may be the command, see self_proving) */
+    if (!strncmp(datum->buffet.tbuffer,
+                 AUTH_CHECK_MSG, sizeof(AUTH_CHECK_MSG))) {
+      /* Turn around the buffer and toss it back */
+      status = handle_turnaround(datum);
+      clear_buffet(&datum->buffet);
       #ifndef NDEBUG
       fprintf(stderr,
-              "[thread %lu] INFO: worker connected to client\n",
+              "[client %lu] INFO: authentication successful\n",
               datum->id);
       #endif
-      /* Receive a "hello" message from the client */
-      recv_message(&datum->buffet, datum->sock);
-      /* Decrypt it with the default key */
-      decrypt_message(&datum->buffet, keystore.key);
-      /* Verify it is an authentication request */
-      if (strncmp(datum->buffet.tbuffer,
-                  AUTH_CHECK_MSG, sizeof(AUTH_CHECK_MSG))) {
-        /* Respond with nonce (misdirection) */
-        gcry_create_nonce(datum->buffet.pbuffer, MAX_COMMAND_LENGTH);
-        encrypt_message(&datum->buffet, keystore.key);
-        send_message(&datum->buffet, datum->sock);
-      } else {
-        /* Request a session key */
-        gcry_pthread_mutex_lock((void **)(&session_data.keystore_mutex));
-        #ifndef NDEBUG
-        print_keystore(stderr, "before request");
-        #endif
-        request_key(&datum->credentials.key);
-        #ifndef NDEBUG
-        print_keystore(stderr, "after request");
-        #endif
-        gcry_pthread_mutex_unlock((void **)(&session_data.keystore_mutex));
-        /* Encrypted it using the default key */
-        salt_and_pepper((char *)(datum->credentials.key), NULL,
-                        &datum->buffet);
-        encrypt_message(&datum->buffet, keystore.key);
-        send_message(&datum->buffet, datum->sock);
-        clear_buffet(&datum->buffet);
-        /* Repeatedly poll for message streams */
-        while (handle_stream(datum) == BANKING_SUCCESS);
-        /* Revoke the session key */
-        gcry_pthread_mutex_lock((void **)(&session_data.keystore_mutex));
-        #ifndef NDEBUG
-        print_keystore(stderr, "before revoke");
-        #endif
-        revoke_key(&datum->credentials.key);
-        #ifndef NDEBUG
-        print_keystore(stderr, "after revoke");
-        #endif
-        gcry_pthread_mutex_unlock((void **)(&session_data.keystore_mutex));
-      }
-      /* Cleanup (disconnect) */
+      datum->state = CLIENT_COMMAND;
+      return status;
+    }
+    if (!self_proving(&datum->credentials)) {
+      #ifndef NDEBUG
+      fprintf(stderr,
+              "[client %lu] INFO: malformed authentication message\n",
+              datum->id);
+      #endif
+      queue_mumble(datum, &datum->credentials);
+      return BANKING_FAILURE;
+    }
+    /* Otherwise it was authentic (and in sequence), so it is a command */
+    /* FALLTHROUGH */
+  case CLIENT_COMMAND:
+    /* Transactions are binary, if the session says so (and they are) */
+    if (datum->credentials.framing >= FRAME_VERSION_BINARY
+     && is_message(datum->buffet.tbuffer)) {
       #ifndef NDEBUG
       fprintf(stderr,
-              "[thread %lu] INFO: worker disconnected from client\n",
+              "[client %lu] INFO: worker received binary message:\n",
               datum->id);
+      hexdump(stderr, (unsigned char *)(datum->buffet.tbuffer),
+              MESSAGE_FIXED_LENGTH);
       #endif
+      /* Malformed messages are treated as malformed commands */
+      if (read_message((unsigned char *)(datum->buffet.tbuffer),
+                       datum->buffet.tlength ? datum->buffet.tlength
+                                             : MAX_COMMAND_LENGTH,
+                       &request)) {
+        queue_mumble(datum, &datum->credentials);
+        clear_buffet(&datum->buffet);
+        return BANKING_FAILURE;
+      }
+      datum->state = CLIENT_AUTH;
+      status = answer_request(datum, &request, 1);
       clear_buffet(&datum->buffet);
-      destroy_socket(datum->sock);
-      datum->sock = BANKING_FAILURE;
-    } else {
+      return status;
+    }
+    /* Copy the command into a buffer so the buffet may be reused */
+    strncpy(msg, datum->buffet.tbuffer, MAX_COMMAND_LENGTH);
+    #ifndef NDEBUG
+    /* Local echo for all received messages */
+    fprintf(stderr,
+            "[client %lu] INFO: worker received message:\n",
+            datum->id);
+    hexdump(stderr, (unsigned char *)(msg), MAX_COMMAND_LENGTH);
+    #endif
+    /* Disconnect from any client that issues malformed commands */
+    if (fetch_handle(msg, &hdl, &args)) {
+      queue_mumble(datum, &datum->credentials);
+      clear_buffet(&datum->buffet);
+      return BANKING_FAILURE;
+    }
+    /* Handlers may ask for more, otherwise expect authentication */
+    datum->state = CLIENT_AUTH;
+    status = hdl(datum, args);
+    clear_buffet(&datum->buffet);
+    return status;
+  case CLIENT_RESUME:
+    datum->state = CLIENT_AUTH;
+    status = datum->resume(datum);
+    clear_buffet(&datum->buffet);
+    return status;
+  default:
+    return BANKING_FAILURE;
+  }
+}
+
+/*! \brief Deliver as many queued replies as the socket will take
+ *
+ *  Replies produced by one batch of frames go out in one send.
+ */
+int
+flush_replies(struct client_data_t * datum)
+{
+  int status;
+
+  if (seal_replies(datum)) {
+    return BANKING_FAILURE;
+  }
+  status = send_message_async(datum->outbox, datum->queued,
+                              datum->source.sock, &datum->sent);
+  /* Anything left over is moved to the front of the outbox */
+  if (datum->sent) {
+    memmove(datum->outbox, datum->outbox + datum->sent,
+            datum->queued - datum->sent);
+    datum->queued -= datum->sent;
+    datum->sent = 0;
+  }
+  return status;
+}
+
+void
+disconnect_client(struct client_data_t * datum)
+{
+  /* Cleanup (disconnect) */
+  #ifndef NDEBUG
+  fprintf(stderr,
+          "[client %lu] INFO: worker disconnected from client\n",
+          datum->id);
+  #endif
+  unwatch_source(&session_data.loop, &datum->source);
+  /* Revoke the session key (unless it expired, or was never issued) */
+  #ifndef NDEBUG
+  print_keystore(stderr, "before revoke");
+  #endif
+  revoke_credentials(&datum->credentials);
+  #ifndef NDEBUG
+  print_keystore(stderr, "after revoke");
+  #endif
+  clear_buffet(&datum->buffet);
+  destroy_socket(datum->source.sock);
+
+  /* Forget about the client entirely */
+  pthread_mutex_lock(&session_data.clients_mutex);
+  if (datum->prev) {
+    datum->prev->next = datum->next;
+  } else {
+    session_data.clients = datum->next;
+  }
+  if (datum->next) {
+    datum->next->prev = datum->prev;
+  }
+  --session_data.client_count;
+  pthread_mutex_unlock(&session_data.clients_mutex);
+  memset(datum, '\0', sizeof(struct client_data_t));
+  free(datum);
+}
+
+/*! \brief Accept every pending connection on a listener */
+void
+handle_connection(struct event_source_t * listener)
+{
+  int sock;
+  struct client_data_t * datum;
+  struct sockaddr_storage remote_addr;
+  socklen_t remote_addr_len;
+
+  for (;;) {
+    remote_addr_len = sizeof(remote_addr);
+    sock = accept(listener->sock, (struct sockaddr *)(&remote_addr),
+                                  &remote_addr_len);
+    if (sock < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, "ERROR: unable to accept connection\n");
+      }
+      break;
+    }
+
+    if (set_nonblocking(sock)
+     || !(datum = calloc(1, sizeof(struct client_data_t)))) {
+      fprintf(stderr, "WARNING: refusing connection\n");
+      destroy_socket(sock);
+      continue;
+    }
+    datum->source.sock = sock;
+    datum->source.type = EVENT_CLIENT;
+    datum->state = CLIENT_HELLO;
+    memcpy(&datum->remote_addr, &remote_addr, remote_addr_len);
+    datum->remote_addr_len = remote_addr_len;
+
+    /* Keep track of the client, for shutdown, but refuse anyone beyond
+     * capacity (counted under the same lock, as listeners run at once) */
+    pthread_mutex_lock(&session_data.clients_mutex);
+    if (session_data.client_count >= MAX_CONNECTIONS) {
+      pthread_mutex_unlock(&session_data.clients_mutex);
+      fprintf(stderr, "WARNING: refusing connection\n");
+      free(datum);
+      destroy_socket(sock);
+      continue;
+    }
+    datum->id = ++session_data.client_serial;
+    if ((datum->next = session_data.clients)) {
+      datum->next->prev = datum;
+    }
+    session_data.clients = datum;
+    ++session_data.client_count;
+    pthread_mutex_unlock(&session_data.clients_mutex);
+    #ifndef NDEBUG
+    fprintf(stderr,
+            "[client %lu] INFO: worker connected to client\n",
+            datum->id);
+    #endif
+
+    /* Receive a "hello" message from the client, eventually */
+    if (watch_source(&session_data.loop, &datum->source, EPOLLIN)) {
       fprintf(stderr,
-              "[thread %lu] ERROR: worker unable to connect\n",
+              "[client %lu] ERROR: unable to watch client\n",
               datum->id);
+      disconnect_client(datum);
+    }
+  }
+
+  if (rearm_source(&session_data.loop, listener, EPOLLIN)) {
+    fprintf(stderr, "ERROR: unable to resume listening\n");
+  }
+}
+
+/*! \brief Act on each whole frame in the inbox, while replies fit */
+int
+handle_frames(struct client_data_t * datum)
+{
+  ssize_t length = 0;
+  size_t consumed = 0;
+
+  /* The frame length changes after hello, so it is checked each time, and
+   * there must be room for two replies (as a ticket takes, see below) */
+  while (datum->state != CLIENT_CLOSING && reply_room(datum, 2)
+      && (length = inbox_frame(datum, consumed)) > 0) {
+    memcpy(datum->buffet.cbuffer, datum->inbox + consumed, (size_t)(length));
+    consumed += (size_t)(length);
+    if ((datum->state == CLIENT_HELLO  ? handle_hello(datum)
+       : datum->state == CLIENT_TICKET ? handle_ticket(datum)
+                                       : handle_stream(datum))) {
+      datum->state = CLIENT_CLOSING;
+    }
+  }
+  /* A header we cannot parse leaves no way to find the next frame */
+  if (length < 0) {
+    fprintf(stderr,
+            "[client %lu] WARNING: malformed frame header\n",
+            datum->id);
+    datum->state = CLIENT_CLOSING;
+  }
+  /* Whatever remains (part of a frame, or frames awaiting room) moves up */
+  if (consumed) {
+    memmove(datum->inbox, datum->inbox + consumed,
+            datum->received - consumed);
+    wipe_bytes(datum->inbox + datum->received - consumed, consumed);
+    datum->received -= consumed;
+  }
+  return datum->state != CLIENT_CLOSING && inbox_frame(datum, 0) > 0;
+}
+
+/*! \brief Make whatever progress is possible on a ready client */
+void
+handle_client(struct client_data_t * datum, struct db_handle_t * db_conn)
+{
+  int status, waiting, closed;
+  uint32_t events;
+
+  /* Handlers will query on the calling worker's connection */
+  datum->db_conn = db_conn;
+
+  /* Take in everything the client has sent so far */
+  status = BANKING_PENDING;
+  if (datum->source.events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+    status = recv_frames_async(datum->inbox, sizeof(datum->inbox),
+                               datum->source.sock, &datum->received);
+  }
+  closed = (status == BANKING_FAILURE);
+
+  /* Handle those frames, sending each batch of replies as one, until the
+   * frames run out (or the socket stops taking replies) */
+  do {
+    waiting = handle_frames(datum);
+    status = closed ? BANKING_FAILURE : flush_replies(datum);
+  } while (waiting && status == BANKING_SUCCESS);
+  if (status == BANKING_FAILURE
+   || (status == BANKING_SUCCESS && datum->state == CLIENT_CLOSING)) {
+    disconnect_client(datum);
+    return;
+  }
+
+  /* Otherwise, wait for the client (or its socket) to be ready again */
+  events = (datum->state == CLIENT_CLOSING) ? 0 : EPOLLIN;
+  if (status == BANKING_PENDING && datum->queued) {
+    events |= EPOLLOUT;
+  }
+  if (rearm_source(&session_data.loop, &datum->source, events)) {
+    fprintf(stderr,
+            "[client %lu] ERROR: unable to watch client\n",
+            datum->id);
+    disconnect_client(datum);
+  }
+}
+
+/*! \brief Wait for readiness, queueing ready sources for the workers */
+void *
+handle_dispatch(void * arg)
+{
+  size_t backlog;
+  (void)(arg);
+
+  while (poll_events(&session_data.loop, -1) == BANKING_SUCCESS) {
+    /* Hire a worker for every ready source nobody is waiting to take */
+    if ((backlog = event_backlog(&session_data.loop))) {
+      grow_worker_pool(&session_data.workers, backlog);
+    }
+  }
+  return NULL;
+}
+
+void *
+handle_worker(void * arg)
+{
+  struct db_handle_t * db_conn;
+  struct event_source_t * source;
+  struct worker_t * worker = (struct worker_t *)(arg);
+  struct sigaction * signal_action = worker->pool->arg;
+  #ifndef NDEBUG
+  fprintf(stderr, "[thread %lu] INFO: worker started\n", pthread_self());
+  #endif
+
+  /* Each worker has a database connection to itself */
+  if (!(db_conn = acquire_db(&session_data.db_pool))) {
+    fprintf(stderr,
+            "[thread %lu] WARNING: no database connection available\n",
+            pthread_self());
+  }
+
+  /* Worker thread signal handling is unique */
+  sigaction(SIGUSR1, signal_action, NULL);
+  sigaction(SIGUSR2, signal_action, NULL);
+
+  /* As long as possible, make progress on whatever is ready */
+  while (!session_data.caught_signal) {
+    source = next_event(&session_data.loop, worker->pool->idle_timeout);
+    if (source && source->type == EVENT_LISTENER) {
+      handle_connection(source);
+    } else if (source) {
+      handle_client((struct client_data_t *)(source), db_conn);
+    } else if (session_data.loop.stopped
+            || retire_worker(worker) == BANKING_SUCCESS) {
+      /* Either shutting down, or idle long enough to be redundant */
+      break;
     }
   }
 
   /* Teardown */
-  handle_interruption(0);
+  release_db(&session_data.db_pool, db_conn);
+  release_digests();
+  release_default_cipher();
+  #ifndef NDEBUG
+  fprintf(stderr, "[thread %lu] INFO: worker retiring\n", pthread_self());
+  #endif
   return NULL;
 }
 
 int
 main(int argc, char ** argv)
 {
-  command_t cmd; int i;
+  command_t cmd; int i, backlog, listeners;
   char * in, * args, buffer[MAX_COMMAND_LENGTH];
   struct sigaction thread_signal_action, old_signal_action;
-  struct thread_data_t * thread_datum;
 
   /* Sanitize input */
-  if (argc != 2) {
-    fprintf(stderr, "USAGE: %s port\n", argv[0]);
+  backlog = BANKING_BACKLOG;
+  listeners = 1;
+  session_data.workers.min_workers = BANKING_WORKERS_MIN;
+  session_data.workers.max_workers = BANKING_WORKERS_MAX;
+  session_data.workers.idle_timeout = BANKING_WORKERS_IDLE;
+  session_data.writer.window = BANKING_COMMIT_WINDOW;
+  session_data.writer.batch = BANKING_COMMIT_BATCH;
+  while ((i = getopt(argc, argv, "b:c:i:l:t:w:W:")) != -1) {
+    switch (i) {
+    case 'b':
+      backlog = (int)(strtol(optarg, NULL, 10));
+      break;
+    case 'c':
+      session_data.writer.batch = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      session_data.writer.window =
+       (unsigned int)(strtoul(optarg, NULL, 10));
+      break;
+    case 'l':
+      /* Zero means one listener per online processor */
+      listeners = (int)(strtol(optarg, NULL, 10));
+      if (listeners == 0) {
+        listeners = (int)(sysconf(_SC_NPROCESSORS_ONLN));
+      }
+      if (listeners > MAX_LISTENERS) {
+        listeners = MAX_LISTENERS;
+      }
+      break;
+    case 'i':
+      session_data.workers.idle_timeout =
+       (unsigned int)(strtoul(optarg, NULL, 10));
+      break;
+    case 'w':
+      session_data.workers.min_workers = strtoul(optarg, NULL, 10);
+      break;
+    case 'W':
+      session_data.workers.max_workers = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      argc = 0;
+    }
+  }
+  if (argc - optind != 1 || backlog <= 0 || listeners <= 0
+   || session_data.writer.batch < 1
+   || session_data.workers.min_workers < MIN_WORKERS
+   || session_data.workers.max_workers > MAX_WORKERS
+   || session_data.workers.min_workers > session_data.workers.max_workers) {
+    fprintf(stderr,
+            "USAGE: %s [-b backlog] [-c commit_batch] [-i idle_seconds]"
+            " [-l listeners] [-t commit_usecs] [-w min_workers]"
+            " [-W max_workers] port\n", argv[0]);
     return EXIT_FAILURE;
   }
 
@@ -694,25 +1475,52 @@ main(int argc, char ** argv)
     fprintf(stderr, "FATAL: unable to enter secure mode\n");
     return EXIT_FAILURE;
   }
+  /* Without tickets, sessions are simply never resumed */
+  init_tickets();
 
   /* Database initialization */
-  if (init_db(BANKING_DB_FILE, &session_data.db_conn)) {
+  if (init_db_pool(BANKING_DB_FILE, &session_data.db_pool,
+                   session_data.workers.max_workers)) {
     fprintf(stderr, "FATAL: unable to connect to database\n");
     shutdown_crypto(old_shmid(&i));
     return EXIT_FAILURE;
   }
+  /* Without the writer, no balance could change, so it is not optional
+   * (like every other thread, it starts with all signals blocked) */
+  sigfillset(&thread_signal_action.sa_mask);
+  pthread_sigmask(SIG_SETMASK, &thread_signal_action.sa_mask,
+                               &old_signal_action.sa_mask);
+  if (init_db_writer(BANKING_DB_FILE, &session_data.writer,
+                     session_data.db_pool.admin.cache)) {
+    fprintf(stderr, "FATAL: unable to start writer thread\n");
+    destroy_db_pool(BANKING_DB_FILE, &session_data.db_pool);
+    shutdown_crypto(old_shmid(&i));
+    return EXIT_FAILURE;
+  }
+  pthread_sigmask(SIG_SETMASK, &old_signal_action.sa_mask, NULL);
 
   /* Socket initialization */
-  if ((session_data.sock = init_server_socket(argv[1])) < 0) {
+  if (init_listeners(argv[optind], backlog, listeners)) {
     fprintf(stderr, "FATAL: unable to start server\n");
-    destroy_db(BANKING_DB_FILE, session_data.db_conn);
+    destroy_db_writer(&session_data.writer);
+    destroy_db_pool(BANKING_DB_FILE, &session_data.db_pool);
+    shutdown_crypto(old_shmid(&i));
+    return EXIT_FAILURE;
+  }
+
+  /* Event initialization */
+  if (init_event_loop(&session_data.loop) || watch_listeners()) {
+    fprintf(stderr, "FATAL: unable to watch for connections\n");
+    destroy_listeners();
+    destroy_db_writer(&session_data.writer);
+    destroy_db_pool(BANKING_DB_FILE, &session_data.db_pool);
     shutdown_crypto(old_shmid(&i));
     return EXIT_FAILURE;
   }
 
   /* Thread initialization */
-  gcry_pthread_mutex_init((void **)(&session_data.accept_mutex));
-  gcry_pthread_mutex_init((void **)(&session_data.keystore_mutex));
+  pthread_mutex_init(&session_data.clients_mutex, NULL);
+  init_lock_table(&session_data.account_locks);
   /* Save the old list of blocked signals for later */
   pthread_sigmask(SIG_SETMASK, NULL, &old_signal_action.sa_mask);
   /* Worker threads inherit this mask (ignore everything except SIGUSRs) */
@@ -724,19 +1532,23 @@ main(int argc, char ** argv)
   pthread_sigmask(SIG_SETMASK, &thread_signal_action.sa_mask, NULL);
   /* Afterwhich, all signals should be ignored in the handler */
   sigfillset(&thread_signal_action.sa_mask);
-  /* Kick off the workers */
-  for (i = 0; i < MAX_CONNECTIONS; ++i) {
-    /* Thread data initialization */
-    thread_datum = &session_data.thread_data[i];
-    memset(thread_datum, '\0', sizeof(struct thread_data_t));
-    thread_datum->sock = BANKING_FAILURE;
-    thread_datum->remote_addr_len = sizeof(thread_datum->remote_addr);
-    thread_datum->signal_action = &thread_signal_action;
-    if (pthread_create(&thread_datum->id, NULL, &handle_client,
-                                                thread_datum)) {
-      thread_datum->id = (pthread_t)(BANKING_FAILURE);
-      fprintf(stderr, "WARNING: unable to start worker thread\n");
-    }
+  /* Start the threads that generate and expire session keys */
+  if (start_filler()) {
+    fprintf(stderr, "WARNING: unable to start filler thread\n");
+  }
+  if (start_reaper()) {
+    fprintf(stderr, "WARNING: unable to start reaper thread\n");
+  }
+  /* Kick off the minimum number of workers */
+  if (init_worker_pool(&session_data.workers, &handle_worker,
+                                              &thread_signal_action)) {
+    fprintf(stderr, "WARNING: unable to start worker threads\n");
+  }
+  /* And the dispatcher that feeds them */
+  if (pthread_create(&session_data.dispatcher, NULL,
+                     &handle_dispatch, NULL)) {
+    session_data.dispatcher = (pthread_t)(BANKING_FAILURE);
+    fprintf(stderr, "WARNING: unable to start dispatcher thread\n");
   }
   /* Reset the signal mask to the prior behavior, and ignore SIGUSRs */
   sigaddset(&old_signal_action.sa_mask, SIGUSR1);
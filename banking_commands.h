@@ -61,6 +61,11 @@ int
 deposit_command(char *);
 #endif
 
+#ifdef USE_STATS
+int
+stats_command(char *);
+#endif
+
 typedef int (*command_t)(char *);
 
 struct command_info_t {
@@ -88,6 +93,9 @@ const struct command_info_t commands[] = {
   #ifdef USE_DEPOSIT
   INIT_COMMAND(deposit)
   #endif
+  #ifdef USE_STATS
+  INIT_COMMAND(stats)
+  #endif
   /* A mandatory command */
   { "quit", NULL, sizeof("quit") }
 };
@@ -124,7 +132,7 @@ validate_command(char * cmd, command_t * fun, char ** args)
 
 /* HANDLES ***************************************************************/
 
-typedef struct thread_data_t * handle_arg_t;
+typedef struct client_data_t * handle_arg_t;
 
 #ifdef HANDLE_LOGIN
 int
@@ -156,6 +164,11 @@ int
 handle_deposit_command(handle_arg_t, char *);
 #endif
 
+#ifdef HANDLE_TICKET
+int
+handle_ticket_command(handle_arg_t, char *);
+#endif
+
 typedef int (*handle_t)(handle_arg_t, char *);
 
 struct handle_info_t {
@@ -183,6 +196,9 @@ const struct handle_info_t handles[] = {
   #ifdef HANDLE_DEPOSIT
   INIT_HANDLE(deposit)
   #endif
+  #ifdef HANDLE_TICKET
+  INIT_HANDLE(ticket)
+  #endif
   /* A dummy handle */
   { "ping", NULL, sizeof("ping") }
 };
@@ -0,0 +1,486 @@
+/**
+ * Copyright 2011 by Tor E. Hagemann <hagemt@rpi.edu>
+ * This file is part of Plouton.
+ *
+ * Plouton is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Plouton is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Plouton.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Debugging output (e.g. from checksum) would swamp what is measured */
+#ifndef NDEBUG
+#define NDEBUG
+#endif
+
+/* Standard includes */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+
+/* Thread includes */
+#define USING_PTHREADS
+#include <pthread.h>
+
+/* Local includes */
+#include "banking_constants.h"
+#include "crypto_utils.h"
+
+/*** BENCHMARKS **********************************************************/
+
+/* How many sessions each thread holds open at once, at most (see below) */
+#define BENCH_SESSIONS 0x0800
+
+enum bench_op_t {
+  BENCH_ENCRYPT_MESSAGE,
+  BENCH_DECRYPT_MESSAGE,
+  BENCH_ENCRYPT_SESSION,
+  BENCH_DECRYPT_SESSION,
+  BENCH_ENCRYPT_FRAMES,
+  BENCH_DECRYPT_FRAMES,
+  BENCH_SALT_AND_PEPPER,
+  BENCH_CHECKSUM,
+  BENCH_HMAC,
+  BENCH_REQUEST_KEY,
+  BENCH_REVOKE_KEY,
+  BENCH_OPEN_SESSION,
+  BENCH_OP_COUNT
+};
+
+const char * bench_names[BENCH_OP_COUNT] = {
+  "encrypt_message",
+  "decrypt_message",
+  "encrypt_session",
+  "decrypt_session",
+  "encrypt_frames",
+  "decrypt_frames",
+  "salt_and_pepper",
+  "checksum",
+  "hmac",
+  "request_key",
+  "revoke_key",
+  "open_session"
+};
+
+enum bench_format_t { FORMAT_CSV, FORMAT_JSON };
+
+/*! \brief One thread's share of a run: what to call, and how long it took
+ *
+ *  Each call is timed on its own (so, percentiles include the cost of the
+ *  clock, some tens of nanoseconds), and any set-up it needs (a frame to
+ *  decrypt, a key to revoke) happens outside of the timed region. Calls
+ *  to the batch API take MAX_PENDING_FRAMES frames apiece. The
+ *  thread's whole loop, set-up included, is timed as well: throughput is
+ *  reckoned from that, latency from the calls alone. Sessions (a key, and
+ *  a cipher keyed by it, as at hello) are held open, as the bank holds
+ *  them, until a thread has BENCH_SESSIONS; all are closed, untimed, and
+ *  the thread goes on. So a run opens far more sessions at once than
+ *  secmem could ever hold, and any that fails to open fails the run.
+ */
+struct bench_thread_t {
+  pthread_t id;
+  enum bench_op_t op;
+  enum cipher_suite_t suite;
+  size_t iterations;
+  uint64_t * samples, begun, ended;
+  int status;
+};
+
+struct bench_result_t {
+  enum bench_op_t op;
+  enum cipher_suite_t suite;
+  size_t threads, iterations;
+  double ops_per_sec, ns_per_op;
+  uint64_t p50, p90, p99, max;
+};
+
+pthread_barrier_t bench_start;
+
+inline uint64_t
+bench_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec) * UINT64_C(1000000000)
+       + (uint64_t)(now.tv_nsec);
+}
+
+/*! \brief Prepare a pair of credentials, one per end, sharing one key */
+int
+bench_credentials(struct credential_t * atm, struct credential_t * bank,
+                  enum cipher_suite_t suite)
+{
+  memset(atm, '\0', sizeof(struct credential_t));
+  memset(bank, '\0', sizeof(struct credential_t));
+  if (request_key(&atm->key)) {
+    return BANKING_FAILURE;
+  }
+  bank->key = atm->key;
+  atm->suite = bank->suite = suite;
+  atm->role = ROLE_ATM;
+  bank->role = ROLE_BANK;
+  if (rekey_credentials(atm) || rekey_credentials(bank)) {
+    return BANKING_FAILURE;
+  }
+  return BANKING_SUCCESS;
+}
+
+void *
+bench_thread(void * arg)
+{
+  size_t i, j, opened;
+  uint64_t start;
+  unsigned char * key, digest[AUTH_DIGEST_LENGTH];
+  char commands[MAX_PENDING_FRAMES][MAX_COMMAND_LENGTH];
+  unsigned char frames[MAX_PENDING_FRAMES * MAX_FRAME_LENGTH];
+  struct buffet_t buffet;
+  struct credential_t atm, bank, * held;
+  struct bench_thread_t * self = (struct bench_thread_t *)(arg);
+
+  clear_buffet(&buffet);
+  salt_and_pepper(AUTH_CHECK_MSG, NULL, &buffet);
+  for (i = 0; i < MAX_PENDING_FRAMES; ++i) {
+    memcpy(commands[i], buffet.pbuffer, MAX_COMMAND_LENGTH);
+  }
+  memset(&atm, '\0', sizeof(struct credential_t));
+  memset(&bank, '\0', sizeof(struct credential_t));
+  held = NULL;
+  opened = 0;
+  self->status = BANKING_SUCCESS;
+  switch (self->op) {
+  case BENCH_DECRYPT_MESSAGE:
+    encrypt_message(&buffet, keystore.key);
+    break;
+  case BENCH_ENCRYPT_SESSION:
+  case BENCH_DECRYPT_SESSION:
+  case BENCH_ENCRYPT_FRAMES:
+  case BENCH_DECRYPT_FRAMES:
+    self->status = bench_credentials(&atm, &bank, self->suite);
+    break;
+  case BENCH_OPEN_SESSION:
+    held = calloc(BENCH_SESSIONS, sizeof(struct credential_t));
+    self->status = held ? BANKING_SUCCESS : BANKING_FAILURE;
+    break;
+  default:
+    break;
+  }
+
+  /* Everyone starts at once (even those that failed, so none waits) */
+  pthread_barrier_wait(&bench_start);
+  self->begun = bench_clock();
+  for (i = 0; !self->status && i < self->iterations; ++i) {
+    switch (self->op) {
+    case BENCH_ENCRYPT_MESSAGE:
+      start = bench_clock();
+      encrypt_message(&buffet, keystore.key);
+      break;
+    case BENCH_DECRYPT_MESSAGE:
+      start = bench_clock();
+      decrypt_message(&buffet, keystore.key);
+      break;
+    case BENCH_ENCRYPT_SESSION:
+      start = bench_clock();
+      encrypt_session(&buffet, &atm);
+      break;
+    case BENCH_DECRYPT_SESSION:
+      /* Frames must arrive in order, so each is freshly sent */
+      encrypt_session(&buffet, &atm);
+      start = bench_clock();
+      self->status = decrypt_session(&buffet, &bank);
+      break;
+    case BENCH_ENCRYPT_FRAMES:
+      start = bench_clock();
+      encrypt_frames(&atm, commands[0], NULL, NULL,
+                     frames, MAX_PENDING_FRAMES);
+      break;
+    case BENCH_DECRYPT_FRAMES:
+      encrypt_frames(&atm, commands[0], NULL, NULL,
+                     frames, MAX_PENDING_FRAMES);
+      start = bench_clock();
+      if (decrypt_frames(&bank, frames, commands[0], NULL, NULL,
+                         MAX_PENDING_FRAMES) != MAX_PENDING_FRAMES) {
+        self->status = BANKING_FAILURE;
+      }
+      break;
+    case BENCH_SALT_AND_PEPPER:
+      start = bench_clock();
+      salt_and_pepper(AUTH_CHECK_MSG, NULL, &buffet);
+      break;
+    case BENCH_CHECKSUM:
+      start = bench_clock();
+      checksum(buffet.pbuffer, NULL, digest);
+      break;
+    case BENCH_HMAC:
+      start = bench_clock();
+      compute_digest(digest, keystore.key, AUTH_KEY_LENGTH,
+                     buffet.cbuffer, MAX_COMMAND_LENGTH);
+      break;
+    case BENCH_REQUEST_KEY:
+      start = bench_clock();
+      self->status = request_key(&key);
+      self->samples[i] = bench_clock() - start;
+      revoke_key(&key);
+      continue;
+    case BENCH_REVOKE_KEY:
+      self->status = request_key(&key);
+      start = bench_clock();
+      revoke_key(&key);
+      break;
+    case BENCH_OPEN_SESSION:
+      if (opened == BENCH_SESSIONS) {
+        for (j = 0; j < opened; ++j) {
+          revoke_credentials(&held[j]);
+        }
+        opened = 0;
+      }
+      held[opened].suite = self->suite;
+      held[opened].role = ROLE_BANK;
+      start = bench_clock();
+      if (request_key(&held[opened].key)
+       || rekey_credentials(&held[opened])) {
+        self->status = BANKING_FAILURE;
+      }
+      ++opened;
+      break;
+    default:
+      self->status = BANKING_FAILURE;
+      continue;
+    }
+    self->samples[i] = bench_clock() - start;
+  }
+  self->ended = bench_clock();
+
+  /* Teardown (the bank's half shares the key, so only one revokes it) */
+  if (atm.key) {
+    revoke_credentials(&atm);
+  }
+  if (bank.cipher) {
+    gcry_cipher_close(bank.cipher);
+  }
+  for (j = 0; j < opened; ++j) {
+    revoke_credentials(&held[j]);
+  }
+  free(held);
+  release_digests();
+  release_default_cipher();
+  clear_buffet(&buffet);
+  return NULL;
+}
+
+int
+compare_samples(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *)(a), y = *(const uint64_t *)(b);
+  return (x > y) - (x < y);
+}
+
+/*! \brief Run op on each of threads threads, iterations calls apiece */
+int
+run_benchmark(struct bench_result_t * result, enum bench_op_t op,
+              enum cipher_suite_t suite, size_t threads, size_t iterations)
+{
+  size_t i, j, total;
+  uint64_t begun, ended, elapsed, sum, * samples;
+  struct bench_thread_t * workers;
+  int status = BANKING_SUCCESS;
+
+  total = threads * iterations;
+  workers = calloc(threads, sizeof(struct bench_thread_t));
+  samples = calloc(total, sizeof(uint64_t));
+  if (!workers || !samples) {
+    fprintf(stderr, "ERROR: unable to allocate samples\n");
+    free(workers);
+    free(samples);
+    return BANKING_FAILURE;
+  }
+  pthread_barrier_init(&bench_start, NULL, (unsigned)(threads + 1));
+  for (i = 0; i < threads; ++i) {
+    workers[i].op = op;
+    workers[i].suite = suite;
+    workers[i].iterations = iterations;
+    workers[i].samples = samples + i * iterations;
+    if (pthread_create(&workers[i].id, NULL, &bench_thread, &workers[i])) {
+      fprintf(stderr, "FATAL: unable to start benchmark thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* Wall time runs from the first thread's start to the last one's end */
+  pthread_barrier_wait(&bench_start);
+  begun = UINT64_MAX;
+  ended = 0;
+  for (i = 0; i < threads; ++i) {
+    pthread_join(workers[i].id, NULL);
+    if (workers[i].status) {
+      status = BANKING_FAILURE;
+    }
+    begun = (workers[i].begun < begun) ? workers[i].begun : begun;
+    ended = (workers[i].ended > ended) ? workers[i].ended : ended;
+  }
+  elapsed = ended - begun;
+  pthread_barrier_destroy(&bench_start);
+
+  if (status == BANKING_SUCCESS) {
+    for (sum = 0, j = 0; j < total; ++j) {
+      sum += samples[j];
+    }
+    qsort(samples, total, sizeof(uint64_t), &compare_samples);
+    result->op = op;
+    result->suite = suite;
+    result->threads = threads;
+    result->iterations = iterations;
+    result->ops_per_sec = elapsed ? (double)(total) * 1e9 / elapsed : 0.0;
+    result->ns_per_op = (double)(sum) / total;
+    result->p50 = samples[total / 2];
+    result->p90 = samples[total * 9 / 10];
+    result->p99 = samples[total * 99 / 100];
+    result->max = samples[total - 1];
+  } else {
+    fprintf(stderr, "ERROR: %s (%s) failed\n",
+            bench_names[op], suite_name(suite));
+  }
+  free(workers);
+  free(samples);
+  return status;
+}
+
+/*** OUTPUT **************************************************************/
+
+void
+print_result(FILE * fp, enum bench_format_t format,
+             struct bench_result_t * result, int first)
+{
+  const char * suite = (result->suite == SUITE_NONE)
+                     ? "-" : suite_name(result->suite);
+
+  if (format == FORMAT_JSON) {
+    fprintf(fp, "%s  {\"primitive\": \"%s\", \"suite\": \"%s\", "
+                "\"threads\": %lu, \"iterations\": %lu, "
+                "\"ops_per_sec\": %.1f, \"ns_per_op\": %.1f, "
+                "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+                "\"max_ns\": %llu}",
+            first ? "" : ",\n", bench_names[result->op], suite,
+            (unsigned long)(result->threads),
+            (unsigned long)(result->iterations),
+            result->ops_per_sec, result->ns_per_op,
+            (unsigned long long)(result->p50),
+            (unsigned long long)(result->p90),
+            (unsigned long long)(result->p99),
+            (unsigned long long)(result->max));
+  } else {
+    fprintf(fp, "%s,%s,%lu,%lu,%.1f,%.1f,%llu,%llu,%llu,%llu\n",
+            bench_names[result->op], suite,
+            (unsigned long)(result->threads),
+            (unsigned long)(result->iterations),
+            result->ops_per_sec, result->ns_per_op,
+            (unsigned long long)(result->p50),
+            (unsigned long long)(result->p90),
+            (unsigned long long)(result->p99),
+            (unsigned long long)(result->max));
+  }
+  fflush(fp);
+}
+
+/*** DRIVER **************************************************************/
+
+int
+main(int argc, char ** argv)
+{
+  int i, first, status;
+  size_t t, threads, iterations;
+  enum bench_op_t op;
+  enum cipher_suite_t suite;
+  enum bench_format_t format;
+  struct bench_result_t result;
+
+  /* Sanitize input */
+  format = FORMAT_CSV;
+  iterations = 100000;
+  threads = (size_t)(sysconf(_SC_NPROCESSORS_ONLN));
+  while ((i = getopt(argc, argv, "f:n:t:")) != -1) {
+    switch (i) {
+    case 'f':
+      if (!strcmp(optarg, "json")) {
+        format = FORMAT_JSON;
+      } else if (strcmp(optarg, "csv")) {
+        argc = 0;
+      }
+      break;
+    case 'n':
+      iterations = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      threads = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      argc = 0;
+    }
+  }
+  if (argc != optind || iterations < 1 || threads < 1) {
+    fprintf(stderr,
+            "USAGE: %s [-f csv|json] [-n iterations] [-t threads]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  /* Crypto initialization (keys come ahead of time, as in the bank) */
+  if (init_crypto(NULL)) {
+    fprintf(stderr, "FATAL: unable to enter secure mode\n");
+    return EXIT_FAILURE;
+  }
+  start_filler();
+
+  /* Every primitive, in every suite that matters to it */
+  if (format == FORMAT_JSON) {
+    printf("[\n");
+  } else {
+    printf("primitive,suite,threads,iterations,ops_per_sec,ns_per_op,"
+           "p50_ns,p90_ns,p99_ns,max_ns\n");
+  }
+  status = EXIT_SUCCESS;
+  first = 1;
+  for (op = 0; op < BENCH_OP_COUNT; ++op) {
+    for (suite = SUITE_NONE; suite <= SUITE_AES256_GCM; ++suite) {
+      /* Only the session cipher varies with the suite (the message
+       * cipher is always the legacy one, and the rest use none) */
+      if (op == BENCH_ENCRYPT_SESSION || op == BENCH_DECRYPT_SESSION
+       || op == BENCH_ENCRYPT_FRAMES || op == BENCH_DECRYPT_FRAMES
+       || op == BENCH_OPEN_SESSION) {
+        if (!suite_supported(suite)) {
+          continue;
+        }
+      } else if (suite != ((op == BENCH_ENCRYPT_MESSAGE
+                         || op == BENCH_DECRYPT_MESSAGE)
+                           ? SUITE_SERPENT256_ECB : SUITE_NONE)) {
+        continue;
+      }
+      /* One thread, then all of them */
+      for (t = 1; t; t = (t < threads) ? threads : 0) {
+        if (run_benchmark(&result, op, suite, t, iterations)) {
+          status = EXIT_FAILURE;
+          continue;
+        }
+        print_result(stdout, format, &result, first);
+        first = 0;
+      }
+    }
+  }
+  if (format == FORMAT_JSON) {
+    printf("\n]\n");
+  }
+
+  shutdown_crypto(NULL);
+  return status;
+}
@@ -0,0 +1,220 @@
+/**
+ * Copyright 2011 by Tor E. Hagemann <hagemt@rpi.edu>
+ * This file is part of Plouton.
+ *
+ * Plouton is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Plouton is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Plouton.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_UTILS_H
+#define CACHE_UTILS_H
+
+/* Standard includes */
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Local includes */
+#include "banking_constants.h"
+#include "crypto_utils.h"
+
+/*** ACCOUNT RECORDS *****************************************************/
+
+/*! \brief One account, sized and aligned to occupy a single cache line
+ *
+ *  Keys are lowercase names (see name_key in the accounts table) padded
+ *  with NULs. Only the balance ever changes once a record is filled, and
+ *  it is always read and written atomically. PINs are kept only as their
+ *  HMAC-SHA-256, under a key of the cache's own (see check_pin).
+ */
+struct account_record_t {
+  char key[CACHE_KEY_LENGTH];
+  int64_t balance;
+  unsigned char pin_digest[AUTH_DIGEST_LENGTH];
+} __attribute__((aligned(64)));
+
+/*! \brief An open-addressing (linear probing) table of account records
+ *
+ *  The table is filled once, while the database is loaded, and is never
+ *  resized afterward. So, lookups need no lock at all: readers only race
+ *  with balance updates, which are atomic. Names too long for a key, and
+ *  accounts created after loading, are simply missed (left to SQLite).
+ */
+struct account_cache_t {
+  struct account_record_t * records;
+  size_t mask, count;
+  unsigned char pin_key[AUTH_KEY_LENGTH];
+};
+
+/*! \brief 64-bit FNV-1a, used to place keys */
+inline uint64_t
+hash_bytes(const char * bytes, size_t len) {
+  uint64_t hash = UINT64_C(0xCBF29CE484222325);
+  while (len--) {
+    hash ^= (unsigned char)(*bytes++);
+    hash *= UINT64_C(0x100000001B3);
+  }
+  return hash;
+}
+
+/*! \brief Produce the key for a name, BANKING_FAILURE if it will not fit */
+inline int
+make_key(char * key, const char * name, size_t len) {
+  size_t i;
+  /* Stop at any terminator, as SQLite would */
+  len = strnlen(name, len);
+  if (len == 0 || len >= CACHE_KEY_LENGTH) {
+    return BANKING_FAILURE;
+  }
+  memset(key, '\0', CACHE_KEY_LENGTH);
+  for (i = 0; i < len; ++i) {
+    key[i] = (char)(tolower((unsigned char)(name[i])));
+  }
+  return BANKING_SUCCESS;
+}
+
+/*** INITIALIZATION AND TERMINATION **************************************/
+
+void
+destroy_account_cache(struct account_cache_t * cache)
+{
+  free(cache->records);
+  cache->records = NULL;
+  cache->mask = cache->count = 0;
+  wipe_bytes(cache->pin_key, AUTH_KEY_LENGTH);
+}
+
+/*! \brief Allocate room for at least accounts records (at most half full) */
+int
+init_account_cache(struct account_cache_t * cache, size_t accounts)
+{
+  size_t capacity;
+
+  for (capacity = 16; capacity < 2 * accounts; capacity <<= 1);
+  if (posix_memalign((void **)(&cache->records),
+                     sizeof(struct account_record_t),
+                     capacity * sizeof(struct account_record_t))) {
+    fprintf(stderr, "ERROR: unable to allocate account cache\n");
+    cache->records = NULL;
+    return BANKING_FAILURE;
+  }
+  memset(cache->records, '\0', capacity * sizeof(struct account_record_t));
+  cache->mask = capacity - 1;
+  cache->count = 0;
+  /* PIN digests are keyed anew by each process, so never outlive it */
+  gcry_randomize(cache->pin_key, AUTH_KEY_LENGTH, GCRY_STRONG_RANDOM);
+  return BANKING_SUCCESS;
+}
+
+/*** LOOKUP **************************************************************/
+
+/*! \brief Probe for a key, yielding its record or the empty slot for it */
+struct account_record_t *
+probe_account(struct account_cache_t * cache, const char * key)
+{
+  size_t i;
+  struct account_record_t * record;
+
+  /* Never full (see init_account_cache), so probing always terminates */
+  i = (size_t)(hash_bytes(key, strnlen(key, CACHE_KEY_LENGTH)));
+  for (i &= cache->mask; ; i = (i + 1) & cache->mask) {
+    record = &cache->records[i];
+    if (record->key[0] == '\0'
+     || !memcmp(record->key, key, CACHE_KEY_LENGTH)) {
+      return record;
+    }
+  }
+}
+
+/*! \brief Find the record for an account name (or NULL on a miss) */
+struct account_record_t *
+find_account(struct account_cache_t * cache, const char * name, size_t len)
+{
+  char key[CACHE_KEY_LENGTH];
+  struct account_record_t * record;
+
+  if (!cache || !cache->records || make_key(key, name, len)) {
+    return NULL;
+  }
+  record = probe_account(cache, key);
+  return (record->key[0] == '\0') ? NULL : record;
+}
+
+/*! \brief Add an account while loading (not safe alongside readers) */
+int
+insert_account(struct account_cache_t * cache,
+               const char * name, size_t name_len,
+               const char * pin,  size_t  pin_len, int64_t balance)
+{
+  char key[CACHE_KEY_LENGTH];
+  unsigned char digest[AUTH_DIGEST_LENGTH];
+  struct account_record_t * record;
+
+  /* Keep at least half of the table empty */
+  if (make_key(key, name, name_len) || 2 * (cache->count + 1)
+                                        > cache->mask + 1
+   || compute_digest(digest, cache->pin_key, AUTH_KEY_LENGTH,
+                     pin, strnlen(pin, pin_len))) {
+    return BANKING_FAILURE;
+  }
+  record = probe_account(cache, key);
+  if (record->key[0] == '\0') {
+    memcpy(record->key, key, CACHE_KEY_LENGTH);
+    ++cache->count;
+  }
+  record->balance = balance;
+  memcpy(record->pin_digest, digest, AUTH_DIGEST_LENGTH);
+  wipe_bytes(digest, AUTH_DIGEST_LENGTH);
+  return BANKING_SUCCESS;
+}
+
+/*** BALANCES ************************************************************/
+
+inline int64_t
+load_balance(struct account_record_t * record) {
+  return __atomic_load_n(&record->balance, __ATOMIC_ACQUIRE);
+}
+
+inline void
+store_balance(struct account_record_t * record, int64_t balance) {
+  __atomic_store_n(&record->balance, balance, __ATOMIC_RELEASE);
+}
+
+inline void
+adjust_balance(struct account_record_t * record, int64_t amount) {
+  __atomic_add_fetch(&record->balance, amount, __ATOMIC_ACQ_REL);
+}
+
+/*! \brief BANKING_SUCCESS if pin matches the one on record
+ *
+ *  The digests are compared in constant time (see compare_digests).
+ */
+int
+check_pin(struct account_cache_t * cache, struct account_record_t * record,
+          const char * pin, size_t len)
+{
+  int status;
+  unsigned char digest[AUTH_DIGEST_LENGTH];
+
+  if (compute_digest(digest, cache->pin_key, AUTH_KEY_LENGTH,
+                     pin, strnlen(pin, len))) {
+    return BANKING_FAILURE;
+  }
+  status = compare_digests(digest, record->pin_digest, AUTH_DIGEST_LENGTH);
+  wipe_bytes(digest, AUTH_DIGEST_LENGTH);
+  return status;
+}
+
+#endif /* CACHE_UTILS_H */
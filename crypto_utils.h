@@ -19,19 +19,27 @@
 #ifndef CRYPT_UTILS_H
 #define CRYPT_UTILS_H
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 /* gcrypt includes */
 #define GCRYPT_NO_DEPRECATED
 #include <gcrypt.h>
 #ifdef USING_PTHREADS
 GCRY_THREAD_OPTION_PTHREAD_IMPL; 
+#include <pthread.h>
 #endif
 
 #include "banking_constants.h"
+#include "frame_utils.h"
+#include "message_utils.h"
+#include "slab_utils.h"
 
 /* SHARED MEMORY TODO REMOVE *********************************************/
 
@@ -74,10 +82,196 @@ inline int * old_shmid(int * shmid) {
 
 struct key_list_t {
   time_t issued, expires;
+  unsigned char * key, ** holder;
+  void (*notify)(void *);
+  void * context;
+  struct key_list_t * next, * timer_next, ** timer_link;
+};
+
+/*! \brief Every key issued (or attached), indexed by its address
+ *
+ *  A key's address is its handle: entries are chained in the bucket that
+ *  address hashes to, so revocation is a constant-time (expected) lookup,
+ *  after which the entry and its secure memory are released at once. The
+ *  table doubles whenever it holds as many keys as buckets. With threads,
+ *  every function here takes the keystore's own lock.
+ *
+ *  Each entry is also on the expiry wheel, in the slot for the second it
+ *  expires; expire_keys advances through the slots as time passes, so no
+ *  key outlives its deadline (by more than a tick) and none is scanned
+ *  before it is due. The reaper thread (see start_reaper) does the ticks.
+ *  Keys themselves are slots in locked slabs (see slab_utils.h), and the
+ *  session ciphers keyed by them are opened outside secmem (see
+ *  setkey_credentials), so the bank's sessions are limited by keys, i.e.
+ *  BANKING_KEY_SLAB * BANKING_KEY_SLABS, and MAX_CONNECTIONS, not secmem.
+ *  With threads, new keys are generated ahead of time by the filler, so
+ *  that requests need not wait on the entropy pool.
+ */
+struct keystore_t {
+  time_t issued, expires, swept;
   unsigned char * key;
-  struct key_list_t * next;
+  struct key_list_t ** buckets;
+  struct key_list_t * wheel[AUTH_KEY_SLOTS];
+  struct slab_pool_t slabs;
+  size_t size, count;
+  #ifdef USING_PTHREADS
+  pthread_mutex_t mutex;
+  pthread_cond_t tick, drained;
+  pthread_t reaper, filler;
+  int reaping, filling;
+  /* Keys generated ahead of time, oldest first (see start_filler) */
+  unsigned char * queue[AUTH_KEY_QUEUE];
+  time_t queued[AUTH_KEY_QUEUE];
+  size_t first, depth;
+  #endif
 } keystore;
 
+inline void
+lock_keystore(void) {
+  #ifdef USING_PTHREADS
+  pthread_mutex_lock(&keystore.mutex);
+  #endif
+}
+
+inline void
+unlock_keystore(void) {
+  #ifdef USING_PTHREADS
+  pthread_mutex_unlock(&keystore.mutex);
+  #endif
+}
+
+/*! \brief Map a key's address to a bucket (size is a power of two) */
+inline size_t
+key_bucket(const unsigned char * key, size_t size) {
+  /* Fibonacci hashing, since allocations share their low bits */
+  uint64_t hash = (uint64_t)((uintptr_t)(key)) * UINT64_C(0x9E3779B97F4A7C15);
+  return (size_t)(hash >> 32) & (size - 1);
+}
+
+/*! \brief Map a second to its slot on the expiry wheel */
+inline size_t
+key_slot(time_t when) {
+  return (size_t)(when) & (AUTH_KEY_SLOTS - 1);
+}
+
+/*! \brief Double the number of buckets (keystore locked) */
+void
+grow_keystore(void)
+{
+  size_t i, j, size;
+  struct key_list_t ** buckets, * entry, * next;
+
+  size = keystore.size * 2;
+  /* On failure, chains merely grow longer */
+  if (!(buckets = calloc(size, sizeof(struct key_list_t *)))) {
+    return;
+  }
+  for (i = 0; i < keystore.size; ++i) {
+    for (entry = keystore.buckets[i]; entry; entry = next) {
+      next = entry->next;
+      j = key_bucket(entry->key, size);
+      entry->next = buckets[j];
+      buckets[j] = entry;
+    }
+  }
+  free(keystore.buckets);
+  keystore.buckets = buckets;
+  keystore.size = size;
+}
+
+/*! \brief Index an entry, and schedule its expiry (keystore locked) */
+void
+insert_key_entry(struct key_list_t * entry)
+{
+  size_t i;
+
+  if (keystore.count >= keystore.size) {
+    grow_keystore();
+  }
+  i = key_bucket(entry->key, keystore.size);
+  entry->next = keystore.buckets[i];
+  keystore.buckets[i] = entry;
+  ++keystore.count;
+
+  /* Slots are unordered, so insertion is at the head */
+  entry->timer_link = &keystore.wheel[key_slot(entry->expires)];
+  if ((entry->timer_next = *entry->timer_link)) {
+    entry->timer_next->timer_link = &entry->timer_next;
+  }
+  *entry->timer_link = entry;
+}
+
+/*! \brief Find the entry for a key and unlink it (keystore locked)
+ *
+ *  \return The entry, which the caller must destroy, or NULL if the key
+ *          is not (or no longer) in the keystore
+ */
+struct key_list_t *
+remove_key_entry(const unsigned char * key)
+{
+  struct key_list_t ** link, * entry;
+
+  link = &keystore.buckets[key_bucket(key, keystore.size)];
+  for (; *link; link = &(*link)->next) {
+    if ((*link)->key == key) {
+      entry = *link;
+      *link = entry->next;
+      --keystore.count;
+      /* Then take it off the wheel */
+      if ((*entry->timer_link = entry->timer_next)) {
+        entry->timer_next->timer_link = entry->timer_link;
+      }
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/*! \brief Generate a key in a fresh slot (NULL if none are left) */
+unsigned char *
+generate_key(void)
+{
+  unsigned char * key;
+
+  if ((key = alloc_slot(&keystore.slabs))) {
+    gcry_randomize(key, AUTH_KEY_LENGTH, GCRY_STRONG_RANDOM);
+  }
+  return key;
+}
+
+/*! \brief Take the oldest queued key, or generate one if there are none
+ *
+ *  Each queued key is handed out once (and never to be reused). Any key
+ *  that has waited in the queue as long as a session key lives is stale,
+ *  so it is wiped instead. Draining the queue to half wakes the filler.
+ */
+unsigned char *
+fresh_key(void)
+{
+  unsigned char * key = NULL;
+  #ifdef USING_PTHREADS
+  time_t now = time(NULL);
+
+  lock_keystore();
+  while (!key && keystore.depth) {
+    key = keystore.queue[keystore.first];
+    if (keystore.queued[keystore.first] + AUTH_KEY_TIMEOUT <= now) {
+      free_slot(&keystore.slabs, key);
+      key = NULL;
+    }
+    keystore.queue[keystore.first] = NULL;
+    keystore.first = (keystore.first + 1) % AUTH_KEY_QUEUE;
+    --keystore.depth;
+  }
+  if (keystore.filling && keystore.depth <= AUTH_KEY_QUEUE / 2) {
+    pthread_cond_signal(&keystore.drained);
+  }
+  unlock_keystore();
+  #endif
+
+  return key ? key : generate_key();
+}
+
 int
 attach_key(unsigned char ** key)
 {
@@ -95,19 +289,22 @@ attach_key(unsigned char ** key)
   }
   
   /* Attempt to produce a new key entry */
-  if ((entry = malloc(sizeof(struct key_list_t)))) {
-    /* Allocate randomized bytes */
-    if ((*key = gcry_random_bytes_secure(AUTH_KEY_LENGTH,
-                                         GCRY_STRONG_RANDOM))) {
-      /* Copy AUTH_KEY_LENGTH bytes if available */
-      if (tmp) {
-        memcpy(*key, tmp, AUTH_KEY_LENGTH);
-      }
+  if ((entry = calloc(1, sizeof(struct key_list_t)))) {
+    /* Copy AUTH_KEY_LENGTH bytes if available, otherwise use a new key */
+    if (tmp && (*key = alloc_slot(&keystore.slabs))) {
+      memcpy(*key, tmp, AUTH_KEY_LENGTH);
+    } else if (!tmp) {
+      *key = fresh_key();
+    }
+    if (*key) {
       entry->expires = time(&entry->issued) + AUTH_KEY_TIMEOUT;
       entry->key = *key;
+      /* Expiry will clear whichever pointer the key was attached to */
+      entry->holder = key;
       /* Finally, add the completed key entry */
-      entry->next = keystore.next;
-      keystore.next = entry;
+      lock_keystore();
+      insert_key_entry(entry);
+      unlock_keystore();
       return BANKING_SUCCESS;
     }
     /* Otherwise, forget it */
@@ -126,8 +323,15 @@ request_key(unsigned char ** key) {
   return attach_key(key);
 }
 
+/*! \brief Have notify(context) called when the key expires
+ *
+ *  The callback runs on the reaper thread with the keystore locked, just
+ *  after the key's holder has been cleared. It must be brief, and it must
+ *  not call back into the keystore; revoking the key first guarantees it
+ *  will never run, so context need only live until then.
+ */
 int
-revoke_key(unsigned char ** key)
+watch_key(unsigned char ** key, void (*notify)(void *), void * context)
 {
   struct key_list_t * entry;
 
@@ -136,30 +340,456 @@ revoke_key(unsigned char ** key)
     return BANKING_FAILURE;
   }
 
-  /* Check if the keystore is valid */
-  if (keystore.issued < keystore.expires) {
-    entry = keystore.next;
-    while (entry) {
-      /* Check only valid keys */
-      if (entry->issued < entry->expires) {
-        /* Check if the key matches */
-        if (!strncmp((char *)(entry->key),
-                     (char *)(      *key), AUTH_KEY_LENGTH)) {
-          /* If so, force it to expire and purge */
-          entry->expires = entry->issued;
-          gcry_create_nonce(entry->key, AUTH_KEY_LENGTH);
-          gcry_free(entry->key);
-          entry->key = *key = NULL;
-          return BANKING_SUCCESS;
-        }
-      }
+  lock_keystore();
+  entry = NULL;
+  if (*key) {
+    entry = keystore.buckets[key_bucket(*key, keystore.size)];
+    while (entry && entry->key != *key) {
       entry = entry->next;
     }
   }
+  if (entry) {
+    entry->notify = notify;
+    entry->context = context;
+  }
+  unlock_keystore();
+
+  return entry ? BANKING_SUCCESS : BANKING_FAILURE;
+}
+
+/*! \brief Purge a key entry, which must no longer be in the keystore */
+inline void
+destroy_key_entry(struct key_list_t * entry) {
+  /* The slot is wiped as it is freed */
+  free_slot(&keystore.slabs, entry->key);
+  free(entry);
+}
+
+int
+revoke_key(unsigned char ** key)
+{
+  struct key_list_t * entry;
+
+  /* Sanity check */
+  if (!key) {
+    return BANKING_FAILURE;
+  }
+
+  /* Check if the keystore is valid, then unlink the entry for the key
+   * (which may have expired meanwhile, so *key is only read locked) */
+  entry = NULL;
+  lock_keystore();
+  if (*key && keystore.issued < keystore.expires) {
+    entry = remove_key_entry(*key);
+  }
+  *key = NULL;
+  unlock_keystore();
 
+  /* If found, purge it (there is no need to hold the lock for this) */
+  if (entry) {
+    destroy_key_entry(entry);
+    return BANKING_SUCCESS;
+  }
   return BANKING_FAILURE;
 }
 
+/*! \brief Expire every key whose deadline has passed by now
+ *
+ *  Only the slots for seconds since the last call are visited, and within
+ *  them only entries due on a later turn of the wheel are skipped, so the
+ *  cost is proportional to the number of keys expired (plus one per tick).
+ *  \return The number of keys expired
+ */
+size_t
+expire_keys(time_t now)
+{
+  size_t count;
+  struct key_list_t * entry, * next, * expired;
+
+  count = 0;
+  expired = NULL;
+  lock_keystore();
+  /* After a long stall, one turn of the wheel visits every slot */
+  if (now - keystore.swept >= AUTH_KEY_SLOTS) {
+    keystore.swept = now - AUTH_KEY_SLOTS + 1;
+  }
+  for (; keystore.swept <= now; ++keystore.swept) {
+    entry = keystore.wheel[key_slot(keystore.swept)];
+    for (; entry; entry = next) {
+      next = entry->timer_next;
+      if (entry->expires > now) {
+        continue;
+      }
+      remove_key_entry(entry->key);
+      /* The owner learns first, as the key may not be used after this */
+      if (entry->holder && *entry->holder == entry->key) {
+        *entry->holder = NULL;
+      }
+      if (entry->notify) {
+        entry->notify(entry->context);
+      }
+      entry->next = expired;
+      expired = entry;
+      ++count;
+    }
+  }
+  unlock_keystore();
+
+  /* As with revocation, purge without the lock */
+  for (; expired; expired = next) {
+    next = expired->next;
+    destroy_key_entry(expired);
+  }
+  #ifndef NDEBUG
+  if (count) {
+    fprintf(stderr, "INFO: expired %lu key(s)\n", (unsigned long)(count));
+  }
+  #endif
+  return count;
+}
+
+#ifdef USING_PTHREADS
+/*! \brief Tick the expiry wheel once a second, until stop_reaper */
+void *
+reap_keys(void * arg)
+{
+  struct timespec deadline;
+
+  (void)(arg);
+  pthread_mutex_lock(&keystore.mutex);
+  while (keystore.reaping) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    ++deadline.tv_sec;
+    pthread_cond_timedwait(&keystore.tick, &keystore.mutex, &deadline);
+    if (keystore.reaping) {
+      pthread_mutex_unlock(&keystore.mutex);
+      expire_keys(time(NULL));
+      pthread_mutex_lock(&keystore.mutex);
+    }
+  }
+  pthread_mutex_unlock(&keystore.mutex);
+  return NULL;
+}
+
+/*! \brief Start the thread that expires keys (after init_crypto) */
+int
+start_reaper(void)
+{
+  int status = BANKING_SUCCESS;
+
+  lock_keystore();
+  if (!keystore.reaping) {
+    keystore.reaping = 1;
+    if (pthread_create(&keystore.reaper, NULL, &reap_keys, NULL)) {
+      keystore.reaping = 0;
+      status = BANKING_FAILURE;
+    }
+  }
+  unlock_keystore();
+  return status;
+}
+
+void
+stop_reaper(void)
+{
+  int reaping;
+
+  lock_keystore();
+  if ((reaping = keystore.reaping)) {
+    keystore.reaping = 0;
+    pthread_cond_signal(&keystore.tick);
+  }
+  unlock_keystore();
+  if (reaping && pthread_join(keystore.reaper, NULL)) {
+    fprintf(stderr, "ERROR: failed to collect reaper thread\n");
+  }
+}
+
+/*! \brief Keep the queue of keys full, until stop_filler */
+void *
+fill_keys(void * arg)
+{
+  unsigned char * key;
+
+  (void)(arg);
+  pthread_mutex_lock(&keystore.mutex);
+  while (keystore.filling) {
+    if (keystore.depth == AUTH_KEY_QUEUE) {
+      pthread_cond_wait(&keystore.drained, &keystore.mutex);
+      continue;
+    }
+    /* Entropy may be slow in coming, so never hold the lock for it */
+    pthread_mutex_unlock(&keystore.mutex);
+    key = generate_key();
+    pthread_mutex_lock(&keystore.mutex);
+    if (!key) {
+      /* Out of slots, so wait for some session to take a key */
+      pthread_cond_wait(&keystore.drained, &keystore.mutex);
+    } else if (keystore.filling && keystore.depth < AUTH_KEY_QUEUE) {
+      keystore.queue[(keystore.first + keystore.depth) % AUTH_KEY_QUEUE]
+        = key;
+      keystore.queued[(keystore.first + keystore.depth) % AUTH_KEY_QUEUE]
+        = time(NULL);
+      ++keystore.depth;
+    } else {
+      free_slot(&keystore.slabs, key);
+    }
+  }
+  pthread_mutex_unlock(&keystore.mutex);
+  return NULL;
+}
+
+/*! \brief Start the thread that generates keys (after init_crypto) */
+int
+start_filler(void)
+{
+  int status = BANKING_SUCCESS;
+
+  lock_keystore();
+  if (!keystore.filling) {
+    keystore.filling = 1;
+    if (pthread_create(&keystore.filler, NULL, &fill_keys, NULL)) {
+      keystore.filling = 0;
+      status = BANKING_FAILURE;
+    }
+  }
+  unlock_keystore();
+  return status;
+}
+
+/*! \brief Stop the filler, then wipe whatever keys remain queued */
+void
+stop_filler(void)
+{
+  int filling;
+
+  lock_keystore();
+  if ((filling = keystore.filling)) {
+    keystore.filling = 0;
+    pthread_cond_signal(&keystore.drained);
+  }
+  unlock_keystore();
+  if (filling && pthread_join(keystore.filler, NULL)) {
+    fprintf(stderr, "ERROR: failed to collect filler thread\n");
+  }
+
+  for (; keystore.depth; --keystore.depth) {
+    free_slot(&keystore.slabs, keystore.queue[keystore.first]);
+    keystore.queue[keystore.first] = NULL;
+    keystore.first = (keystore.first + 1) % AUTH_KEY_QUEUE;
+  }
+  keystore.first = 0;
+}
+#endif /* USING_PTHREADS */
+
+/*** CIPHER SUITES *******************************************************/
+
+/*! \brief How session frames are protected, as negotiated at "hello"
+ *
+ *  The ATM offers the suites it supports (see offer_suites), and the bank
+ *  picks its favorite among them (see accept_suite) to deliver alongside
+ *  the session key. Either end that knows nothing of suites (or offers
+ *  nothing the other supports) ends up with the legacy suite: Serpent in
+ *  ECB mode, 80-byte frames, no integrity. The AEAD suites append a tag
+ *  to each frame, and derive each frame's IV from the sender and a count
+ *  of frames sent, so a frame replayed, reordered or dropped fails too.
+ */
+enum cipher_suite_t {
+  SUITE_NONE,              /* Terminates lists of suites */
+  SUITE_SERPENT256_ECB,    /* Legacy */
+  SUITE_CHACHA20_POLY1305, /* Fast without AES instructions */
+  SUITE_AES256_GCM         /* Fast with them */
+};
+
+enum session_role_t { ROLE_ATM, ROLE_BANK };
+
+/*! \brief Supported suites, most preferred first (see init_suites) */
+unsigned char preferred_suites[AUTH_SUITE_COUNT + 1];
+
+inline const char *
+suite_name(enum cipher_suite_t suite) {
+  switch (suite) {
+  case SUITE_AES256_GCM:        return "AES256-GCM";
+  case SUITE_CHACHA20_POLY1305: return "CHACHA20-POLY1305";
+  default:                      return "SERPENT256-ECB";
+  }
+}
+
+/*! \brief Whether the suite appends a tag to each frame */
+inline int
+suite_is_aead(enum cipher_suite_t suite) {
+  return suite == SUITE_AES256_GCM || suite == SUITE_CHACHA20_POLY1305;
+}
+
+/*! \brief Decide which suites to support, and in what order */
+void
+init_suites(void)
+{
+  size_t i = 0;
+  char * hwflist;
+  int aes = 0;
+
+  /* libgcrypt reports instructions it uses, e.g. "intel-aesni" */
+  if ((hwflist = gcry_get_config(0, "hwflist"))) {
+    aes = strstr(hwflist, "aes") || strstr(hwflist, "vcrypto");
+    gcry_free(hwflist);
+  }
+  if (aes && !gcry_cipher_test_algo(GCRY_CIPHER_AES256)) {
+    preferred_suites[i++] = SUITE_AES256_GCM;
+  }
+  if (!gcry_cipher_test_algo(GCRY_CIPHER_CHACHA20)) {
+    preferred_suites[i++] = SUITE_CHACHA20_POLY1305;
+  }
+  if (!aes && !gcry_cipher_test_algo(GCRY_CIPHER_AES256)) {
+    preferred_suites[i++] = SUITE_AES256_GCM;
+  }
+  preferred_suites[i++] = SUITE_SERPENT256_ECB;
+  preferred_suites[i] = SUITE_NONE;
+  #ifndef NDEBUG
+  fprintf(stderr, "INFO: preferred cipher suite: %s\n",
+          suite_name(preferred_suites[0]));
+  #endif
+}
+
+/*! \brief Whether suite is one this end supports */
+inline int
+suite_supported(int suite) {
+  return suite != SUITE_NONE
+      && memchr(preferred_suites, suite, AUTH_SUITE_COUNT) != NULL;
+}
+
+/*! \brief Write our offer (AUTH_SUITE_MSG, then suites) into a message */
+inline void
+offer_suites(char * buffer) {
+  memcpy(buffer, AUTH_SUITE_MSG, sizeof(AUTH_SUITE_MSG));
+  memcpy(buffer + sizeof(AUTH_SUITE_MSG),
+         preferred_suites, AUTH_SUITE_COUNT + 1);
+}
+
+/*! \brief Choose our favorite among those offered (by offer_suites)
+ *
+ *  \param buffer Whatever follows the hello, which from older ATMs is
+ *                nonce (so without the marker, the offer is ignored)
+ */
+enum cipher_suite_t
+accept_suite(const char * buffer)
+{
+  size_t i;
+  const char * offer = buffer + sizeof(AUTH_SUITE_MSG);
+
+  if (memcmp(buffer, AUTH_SUITE_MSG, sizeof(AUTH_SUITE_MSG))) {
+    return SUITE_SERPENT256_ECB;
+  }
+  for (i = 0; preferred_suites[i] != SUITE_NONE; ++i) {
+    if (memchr(offer, preferred_suites[i], AUTH_SUITE_COUNT)) {
+      return (enum cipher_suite_t)(preferred_suites[i]);
+    }
+  }
+  return SUITE_SERPENT256_ECB;
+}
+
+/*! \brief The suite the bank chose (legacy, unless it is one we offered) */
+inline enum cipher_suite_t
+confirm_suite(const char * buffer) {
+  return (!memcmp(buffer, AUTH_SUITE_MSG, sizeof(AUTH_SUITE_MSG))
+       && suite_supported(buffer[sizeof(AUTH_SUITE_MSG)]))
+       ? (enum cipher_suite_t)(buffer[sizeof(AUTH_SUITE_MSG)])
+       : SUITE_SERPENT256_ECB;
+}
+
+/*! \brief The length of fixed frames under a suite */
+inline size_t
+frame_length(enum cipher_suite_t suite) {
+  return MAX_COMMAND_LENGTH + (suite_is_aead(suite) ? AUTH_TAG_LENGTH : 0);
+}
+
+/*! \brief Open a cipher handle for the suite, with flags (such as
+ *         GCRY_CIPHER_SECURE, to draw it from secmem)
+ */
+inline gcry_error_t
+open_suite(gcry_cipher_hd_t * handle, enum cipher_suite_t suite,
+           unsigned int flags) {
+  switch (suite) {
+  case SUITE_AES256_GCM:
+    return gcry_cipher_open(handle, GCRY_CIPHER_AES256,
+                                    GCRY_CIPHER_MODE_GCM, flags);
+  case SUITE_CHACHA20_POLY1305:
+    return gcry_cipher_open(handle, GCRY_CIPHER_CHACHA20,
+                                    GCRY_CIPHER_MODE_POLY1305, flags);
+  default:
+    return gcry_cipher_open(handle, GCRY_CIPHER_SERPENT256,
+                                    GCRY_CIPHER_MODE_ECB, flags);
+  }
+}
+
+/*! \brief The IV for the count'th frame sent by sender
+ *
+ *  Counts never restart within a session (not even when the key is mixed
+ *  back to an earlier value), so no IV is ever used twice with one key.
+ */
+inline void
+frame_iv(unsigned char * iv, enum session_role_t sender, uint64_t count) {
+  int i;
+  memset(iv, '\0', AUTH_IV_LENGTH);
+  iv[0] = (sender == ROLE_BANK) ? 'B' : 'A';
+  for (i = AUTH_IV_LENGTH - 1; i >= AUTH_IV_LENGTH - 8; --i) {
+    iv[i] = (unsigned char)(count & 0xFF);
+    count >>= 8;
+  }
+}
+
+/*! \brief A cipher under the default key, private to one thread
+ *
+ *  Hello and resumption frames are under the default key (keystore.key),
+ *  which does not change once init_crypto has it, so rather than open and
+ *  key a handle per frame, each thread keys one on first use and keeps it
+ *  (ECB has no state to carry over between frames). Any other key is set
+ *  afresh on each use, as its slot may be revoked and handed out again. A
+ *  thread that used it must call release_default_cipher before it exits.
+ */
+struct default_cipher_t {
+  gcry_cipher_hd_t handle;
+  const void * key;
+};
+
+__thread struct default_cipher_t default_cipher;
+
+/*! \brief This thread's cipher, keyed by key (NULL on failure) */
+gcry_cipher_hd_t
+fetch_default_cipher(const void * key)
+{
+  if (!default_cipher.handle) {
+    if (gcry_cipher_open(&default_cipher.handle, GCRY_CIPHER_SERPENT256,
+                                                 GCRY_CIPHER_MODE_ECB,
+                                                 GCRY_CIPHER_SECURE)) {
+      fprintf(stderr, "ERROR: unable to open cipher\n");
+      default_cipher.handle = NULL;
+      return NULL;
+    }
+    default_cipher.key = NULL;
+  }
+  if (key != default_cipher.key) {
+    if (gcry_cipher_setkey(default_cipher.handle, key, AUTH_KEY_LENGTH)) {
+      fprintf(stderr, "ERROR: unable to key cipher\n");
+      default_cipher.key = NULL;
+      return NULL;
+    }
+    default_cipher.key = (key == keystore.key) ? key : NULL;
+  }
+  return default_cipher.handle;
+}
+
+/*! \brief Close this thread's cipher under the default key */
+void
+release_default_cipher(void)
+{
+  if (default_cipher.handle) {
+    gcry_cipher_close(default_cipher.handle);
+    default_cipher.handle = NULL;
+    default_cipher.key = NULL;
+  }
+}
+
 /*** INITIALIZATION AND TERMINATION **************************************/
 
 /* \brief TODO REPLACE
@@ -187,7 +817,31 @@ init_crypto(const int * const shmid)
     keystore.key = malloc(AUTH_KEY_LENGTH * sizeof(unsigned char));
     strncpy((char *)keystore.key, AUTH_CHECK_MSG, sizeof(AUTH_CHECK_MSG));
   }
-  keystore.next = NULL;
+
+  /* Prepare the slabs that hold keys */
+  if (init_slab_pool(&keystore.slabs, AUTH_KEY_LENGTH,
+                     BANKING_KEY_SLAB, BANKING_KEY_SLABS)) {
+    fprintf(stderr, "ERROR: unable to allocate key storage\n");
+    return BANKING_FAILURE;
+  }
+
+  /* Prepare the index of keys, and the wheel that expires them */
+  keystore.swept = keystore.issued;
+  memset(keystore.wheel, '\0', sizeof(keystore.wheel));
+  keystore.count = 0;
+  keystore.size = AUTH_KEY_BUCKETS;
+  if (!(keystore.buckets = calloc(keystore.size,
+                                  sizeof(struct key_list_t *)))) {
+    fprintf(stderr, "ERROR: unable to allocate keystore\n");
+    return BANKING_FAILURE;
+  }
+  #ifdef USING_PTHREADS
+  pthread_mutex_init(&keystore.mutex, NULL);
+  pthread_cond_init(&keystore.tick, NULL);
+  pthread_cond_init(&keystore.drained, NULL);
+  keystore.reaping = keystore.filling = 0;
+  keystore.first = keystore.depth = 0;
+  #endif
 
   /* Load thread callbacks */
   #ifdef USING_PTHREADS
@@ -200,7 +854,8 @@ init_crypto(const int * const shmid)
     return BANKING_FAILURE;
   }
 
-  /* Set up secure memory pool */
+  /* Set up secure memory pool (for each thread's digests and default-key
+   * cipher, and the ticket ciphers: sessions' ciphers live outside it) */
   gcry_control(GCRYCTL_SUSPEND_SECMEM_WARN);
   gcry_control(GCRYCTL_INIT_SECMEM, BANKING_SECMEM, 0);
   gcry_control(GCRYCTL_RESUME_SECMEM_WARN);
@@ -211,14 +866,23 @@ init_crypto(const int * const shmid)
     fprintf(stderr, "ERROR: gcrypt was not properly initialized\n");
     return BANKING_FAILURE;
   }
+  init_suites();
   return BANKING_SUCCESS;
 }
 
 void
 shutdown_crypto(const int * const shmid)
 {
+  size_t i;
   struct key_list_t * current, * next;
 
+  /* Nothing may expire (or be queued) while the keys are purged */
+  #ifdef USING_PTHREADS
+  stop_reaper();
+  stop_filler();
+  #endif
+  release_default_cipher();
+
   /* Destroy the keystore */
   keystore.issued = keystore.expires = 0;
 
@@ -231,19 +895,23 @@ shutdown_crypto(const int * const shmid)
     free(keystore.key);
   }
 
-  /* Invalidate all the keys */
-  current = keystore.next;
-  while (current) {
-    current->expires = current->issued;
-    if (current->key) {
-      gcry_free(current->key);
-      current->key = NULL;
+  /* Purge all the keys */
+  for (i = 0; i < keystore.size; ++i) {
+    for (current = keystore.buckets[i]; current; current = next) {
+      next = current->next;
+      destroy_key_entry(current);
     }
-    next = current->next;
-    free(current);
-    current = next;
   }
-  keystore.next = NULL;
+  free(keystore.buckets);
+  keystore.buckets = NULL;
+  keystore.size = keystore.count = 0;
+  memset(keystore.wheel, '\0', sizeof(keystore.wheel));
+  destroy_slab_pool(&keystore.slabs);
+  #ifdef USING_PTHREADS
+  pthread_cond_destroy(&keystore.drained);
+  pthread_cond_destroy(&keystore.tick);
+  pthread_mutex_destroy(&keystore.mutex);
+  #endif
 
   /* Destroy secure memory pool */
   gcry_control(GCRYCTL_TERM_SECMEM);
@@ -254,11 +922,21 @@ shutdown_crypto(const int * const shmid)
 /*! \brief A buffet is an array of buffers, used for encryption/decryption
  *
  *  Inside are the members pbuffer, cbuffer, and tbuffer. For convenience,
- *  cbuffer is an unsigned char[], and the others are char[]s. 
+ *  cbuffer is an unsigned char[], and the others are char[]s. A frame on
+ *  the wire is the first framelength bytes of cbuffer: encryption sets it
+ *  (per the cipher suite), and reception expects frames of that length,
+ *  unless framing is set (then, each frame's header gives its length).
+ *  With framing, only the first plength bytes of pbuffer (all, if zero)
+ *  are sent, padded to a block, and tlength is the bytes that arrived.
+ *  Likewise, prequest names what is sent (see encrypt_frames), and
+ *  trequest what arrived.
  */
 struct buffet_t {
   char pbuffer[MAX_COMMAND_LENGTH], tbuffer[MAX_COMMAND_LENGTH];
-  unsigned char cbuffer[MAX_COMMAND_LENGTH];
+  unsigned char cbuffer[MAX_FRAME_LENGTH];
+  size_t framelength, plength, tlength;
+  uint32_t prequest, trequest;
+  unsigned char framing;
 };
 
 /*! \brief Ensure that all buffers are clear */
@@ -266,69 +944,297 @@ inline void
 clear_buffet(struct buffet_t * buffet) {
   if (buffet) {
     memset(buffet->pbuffer, '\0', MAX_COMMAND_LENGTH);
-    memset(buffet->cbuffer, '\0', MAX_COMMAND_LENGTH);
+    memset(buffet->cbuffer, '\0', MAX_FRAME_LENGTH);
     memset(buffet->tbuffer, '\0', MAX_COMMAND_LENGTH);
+    buffet->plength = buffet->tlength = 0;
+    buffet->prequest = buffet->trequest = 0;
   }
 }
 
-inline void
+/*! \brief The length of a frame (before a suite is chosen, a legacy one) */
+inline size_t
+frame_bytes(struct buffet_t * buffet) {
+  return buffet->framelength ? buffet->framelength : MAX_COMMAND_LENGTH;
+}
+
+/*! \brief Encrypt pbuffer under the default key (see default_cipher) */
+inline int
 encrypt_message(struct buffet_t * buffet, void * key) {
-  /* TODO handle gcry_error_t error_code's? */
   gcry_cipher_hd_t handle;
 
-  if (buffet && key) {
-    gcry_cipher_open(&handle, GCRY_CIPHER_SERPENT256,
-                              GCRY_CIPHER_MODE_ECB,
-                              GCRY_CIPHER_SECURE);
-    gcry_cipher_setkey(handle, key,
-                               AUTH_KEY_LENGTH);
+  if (buffet && key && (handle = fetch_default_cipher(key))) {
     gcry_cipher_encrypt(handle, buffet->cbuffer,
                                 MAX_COMMAND_LENGTH,
                                 (unsigned char *)(buffet->pbuffer),
                                 MAX_COMMAND_LENGTH);
-    gcry_cipher_close(handle);
+    buffet->framelength = MAX_COMMAND_LENGTH;
+    return BANKING_SUCCESS;
   }
+  return BANKING_FAILURE;
 }
 
-inline void
+/*! \brief Decrypt cbuffer under the default key (see default_cipher) */
+inline int
 decrypt_message(struct buffet_t * buffet, void * key) {
-  /* TODO handle gcry_error_t error_code's? */
   gcry_cipher_hd_t handle;
 
-  if (buffet && key) {
-    gcry_cipher_open(&handle, GCRY_CIPHER_SERPENT256,
-                              GCRY_CIPHER_MODE_ECB,
-                              GCRY_CIPHER_SECURE);
-    gcry_cipher_setkey(handle, key,
-                               AUTH_KEY_LENGTH);
+  if (buffet && key && (handle = fetch_default_cipher(key))) {
     gcry_cipher_decrypt(handle, (unsigned char *)(buffet->tbuffer),
                                 MAX_COMMAND_LENGTH,
                                 buffet->cbuffer,
                                 MAX_COMMAND_LENGTH);
-    gcry_cipher_close(handle);
+    return BANKING_SUCCESS;
   }
+  return BANKING_FAILURE;
 }
 
 inline ssize_t
 send_message(struct buffet_t * buffet, int sock) {
-  /* TODO AAA features? */
-  return write(sock, buffet->cbuffer, MAX_COMMAND_LENGTH);
+  /* A lost connection is an error, not a signal (see the ATM's reconnect)
+   * TODO AAA features? */
+  return send(sock, buffet->cbuffer, frame_bytes(buffet), MSG_NOSIGNAL);
 }
 
-inline ssize_t
-recv_message(struct buffet_t * buffet, int sock) {
-  /* TODO AAA features? */
-  return read(sock, buffet->cbuffer, MAX_COMMAND_LENGTH);
+/*! \brief Receive one whole frame, blocking (as in the ATM) */
+ssize_t
+recv_message(struct buffet_t * buffet, int sock)
+{
+  ssize_t len;
+  size_t offset = 0, want;
+
+  /* A variable frame is read as far as its header, which says the rest */
+  want = buffet->framing ? FRAME_HEADER_LENGTH : frame_bytes(buffet);
+  while (offset < want) {
+    len = read(sock, buffet->cbuffer + offset, want - offset);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      return offset ? (ssize_t)(offset) : len;
+    }
+    offset += (size_t)(len);
+    if (buffet->framing && offset == FRAME_HEADER_LENGTH
+     && (len = frame_extent(buffet->cbuffer, offset)) > 0) {
+      want = (size_t)(len);
+    }
+  }
+  return (ssize_t)(offset);
 }
 
-/*** CREDENTIALS *********************************************************/
-
-struct credential_t {
-  char username[MAX_COMMAND_LENGTH];
-  unsigned char * key;
-  size_t userlength;
-};
-
+/*! \brief Read whatever a non-blocking socket holds, up to len in all
+ *
+ *  Frames are taken in bulk (as many as have arrived, in one read if the
+ *  client pipelines them), and left to the caller to pick apart.
+ *
+ *  \param offset  Bytes of data already filled (updated in place)
+ *  \return        BANKING_PENDING once the socket would block,
+ *                 BANKING_SUCCESS if data filled up first, or
+ *                 BANKING_FAILURE on disconnection or error
+ */
+int
+recv_frames_async(unsigned char * data, size_t len,
+                  int sock, size_t * offset)
+{
+  ssize_t received;
+
+  while (*offset < len) {
+    received = read(sock, data + *offset, len - *offset);
+    if (received > 0) {
+      *offset += (size_t)(received);
+    } else if (received < 0 && errno == EINTR) {
+      continue;
+    } else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return BANKING_PENDING;
+    } else {
+      return BANKING_FAILURE;
+    }
+  }
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Continue sending bytes on a non-blocking socket
+ *
+ *  \param offset  Bytes of data already sent (updated in place)
+ *  \return        BANKING_SUCCESS once all len bytes are sent,
+ *                 BANKING_PENDING if the socket would block, or
+ *                 BANKING_FAILURE on disconnection or error
+ */
+int
+send_message_async(const unsigned char * data, size_t len,
+                   int sock, size_t * offset)
+{
+  ssize_t sent;
+
+  while (*offset < len) {
+    sent = send(sock, data + *offset, len - *offset, MSG_NOSIGNAL);
+    if (sent > 0) {
+      *offset += (size_t)(sent);
+    } else if (sent < 0 && errno == EINTR) {
+      continue;
+    } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return BANKING_PENDING;
+    } else {
+      return BANKING_FAILURE;
+    }
+  }
+  return BANKING_SUCCESS;
+}
+
+/*** NONCES *************************************************************/
+
+/*! \brief Nonce bytes drawn ahead of time, private to one thread
+ *
+ *  gcry_create_nonce serializes every caller on one lock, so each thread
+ *  instead takes AUTH_NONCE_CHUNK bytes at a time and serves padding from
+ *  those. Bytes are handed out once and zeroed as they are, so what was
+ *  used (and what remains) is never exposed twice.
+ */
+struct nonce_buffer_t {
+  unsigned char bytes[AUTH_NONCE_CHUNK];
+  size_t remaining;
+};
+
+__thread struct nonce_buffer_t nonce_buffer;
+
+/*! \brief As gcry_create_nonce, but from this thread's buffer */
+void
+fill_nonce(void * buffer, size_t len)
+{
+  size_t n, offset;
+  unsigned char * out = buffer;
+
+  while (len) {
+    if (!nonce_buffer.remaining) {
+      gcry_create_nonce(nonce_buffer.bytes, AUTH_NONCE_CHUNK);
+      nonce_buffer.remaining = AUTH_NONCE_CHUNK;
+    }
+    n = (len < nonce_buffer.remaining) ? len : nonce_buffer.remaining;
+    offset = AUTH_NONCE_CHUNK - nonce_buffer.remaining;
+    memcpy(out, nonce_buffer.bytes + offset, n);
+    wipe_bytes(nonce_buffer.bytes + offset, n);
+    nonce_buffer.remaining -= n;
+    out += n;
+    len -= n;
+  }
+}
+
+/*** DIGESTS *************************************************************/
+
+/*! \brief Hash contexts private to one thread, opened on first use
+ *
+ *  gcry_md_open allocates, so rather than open a context per digest,
+ *  each thread keeps one for SHA-256 and one for HMAC-SHA-256, and resets
+ *  them between uses. Digests (AUTH_DIGEST_LENGTH bytes) are written to
+ *  whatever buffer the caller provides. A thread that computed any must
+ *  call release_digests before it exits.
+ */
+struct digest_context_t {
+  gcry_md_hd_t plain, keyed;
+};
+
+__thread struct digest_context_t digest_context;
+
+/*! \brief Start a digest, an HMAC if key is non-NULL (NULL on failure) */
+gcry_md_hd_t
+begin_digest(const void * key, size_t keylen)
+{
+  gcry_md_hd_t * handle;
+
+  handle = key ? &digest_context.keyed : &digest_context.plain;
+  if (!*handle && gcry_md_open(handle, GCRY_MD_SHA256, key
+                               ? GCRY_MD_FLAG_HMAC | GCRY_MD_FLAG_SECURE
+                               : 0)) {
+    fprintf(stderr, "ERROR: unable to open digest\n");
+    *handle = NULL;
+    return NULL;
+  }
+  gcry_md_reset(*handle);
+  if (key && gcry_md_setkey(*handle, key, keylen)) {
+    fprintf(stderr, "ERROR: unable to key digest\n");
+    return NULL;
+  }
+  return *handle;
+}
+
+inline void
+update_digest(gcry_md_hd_t handle, const void * bytes, size_t len) {
+  gcry_md_write(handle, bytes, len);
+}
+
+/*! \brief Write the digest to buffer, then reset (so no state lingers) */
+inline void
+finish_digest(gcry_md_hd_t handle, unsigned char * buffer) {
+  memcpy(buffer, gcry_md_read(handle, GCRY_MD_SHA256), AUTH_DIGEST_LENGTH);
+  gcry_md_reset(handle);
+}
+
+/*! \brief Digest (or, given a key, HMAC) len bytes into buffer at once */
+int
+compute_digest(unsigned char * buffer, const void * key, size_t keylen,
+               const void * bytes, size_t len)
+{
+  gcry_md_hd_t handle;
+
+  if (!(handle = begin_digest(key, keylen))) {
+    return BANKING_FAILURE;
+  }
+  update_digest(handle, bytes, len);
+  finish_digest(handle, buffer);
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Compare len bytes in time independent of where they differ
+ *
+ *  \return BANKING_SUCCESS if the digests match, else BANKING_FAILURE
+ */
+int
+compare_digests(const unsigned char * a, const unsigned char * b,
+                size_t len)
+{
+  volatile unsigned char difference = 0;
+
+  while (len--) {
+    difference |= *a++ ^ *b++;
+  }
+  return difference ? BANKING_FAILURE : BANKING_SUCCESS;
+}
+
+/*! \brief Close this thread's digest contexts */
+void
+release_digests(void)
+{
+  if (digest_context.plain) {
+    gcry_md_close(digest_context.plain);
+    digest_context.plain = NULL;
+  }
+  if (digest_context.keyed) {
+    gcry_md_close(digest_context.keyed);
+    digest_context.keyed = NULL;
+  }
+}
+
+/*** CREDENTIALS *********************************************************/
+
+/*! \brief What identifies one end of a session
+ *
+ *  The cipher is keyed once from key, then kept for the whole session (see
+ *  encrypt_session), so any change to the key must be followed by a call
+ *  to rekey_credentials (mix_credentials does both). Since key is cleared
+ *  when it expires, both of these read it only with the keystore locked.
+ *  The suite, role and framing (a version, or 0 for fixed frames) are all
+ *  settled at "hello", before the first re-key.
+ */
+struct credential_t {
+  char username[MAX_COMMAND_LENGTH];
+  unsigned char * key;
+  size_t userlength;
+  gcry_cipher_hd_t cipher;
+  enum cipher_suite_t suite;
+  enum session_role_t role;
+  unsigned char framing;
+  uint64_t sent, received;
+};
+
 inline void
 set_username(struct credential_t * credentials, char * buffer,
                                                 size_t len) {
@@ -341,6 +1247,539 @@ set_username(struct credential_t * credentials, char * buffer,
   }
 }
 
+/*! \brief Key the session cipher (opening it, if need be) from key
+ *
+ *  The keystore must be locked, so that the key cannot expire meanwhile.
+ *  The cipher is not drawn from secmem, which is fixed in size and would
+ *  cap the number of sessions well short of MAX_CONNECTIONS; the key it
+ *  is set from stays in its locked slab, and closing the cipher wipes it.
+ */
+int
+setkey_credentials(struct credential_t * credentials)
+{
+  if (!credentials->key) {
+    return BANKING_FAILURE;
+  }
+  if (!credentials->cipher
+   && open_suite(&credentials->cipher, credentials->suite, 0)) {
+    credentials->cipher = NULL;
+    return BANKING_FAILURE;
+  }
+  return gcry_cipher_setkey(credentials->cipher, credentials->key,
+                                                 AUTH_KEY_LENGTH)
+       ? BANKING_FAILURE : BANKING_SUCCESS;
+}
+
+/*! \brief As setkey_credentials, but takes the keystore lock itself */
+inline int
+rekey_credentials(struct credential_t * credentials) {
+  int status;
+  lock_keystore();
+  status = setkey_credentials(credentials);
+  unlock_keystore();
+  return status;
+}
+
+/*! \brief XOR cyclic copies of bytes into the key, then re-key */
+int
+mix_credentials(struct credential_t * credentials,
+                const char * bytes, size_t len)
+{
+  size_t i;
+  int status;
+
+  lock_keystore();
+  if (credentials->key) {
+    for (i = 0; i < AUTH_KEY_LENGTH; ++i) {
+      credentials->key[i] ^= bytes[i % len];
+    }
+  }
+  status = setkey_credentials(credentials);
+  unlock_keystore();
+
+  return status;
+}
+
+/*! \brief Close the session cipher, then revoke the key */
+inline int
+revoke_credentials(struct credential_t * credentials) {
+  gcry_cipher_close(credentials->cipher);
+  credentials->cipher = NULL;
+  return revoke_key(&credentials->key);
+}
+
+/*! \brief Encrypt count commands (MAX_COMMAND_LENGTH bytes apart) into
+ *         frames, which are written back to back
+ *
+ *  The legacy suite needs no IV, so with fixed frames, the whole batch
+ *  goes through the cipher in one call (and libgcrypt may take its multi-
+ *  block path). Otherwise each frame needs its own IV, tag or header (but
+ *  all of them still share one handle).
+ *
+ *  \param lengths  The bytes of each command to send, if framing (NULL, or
+ *                  0 for any one command, sends all MAX_COMMAND_LENGTH)
+ *  \param requests The request each frame names, if tagged (if NULL, each
+ *                  names its own sequence)
+ *  \return         The number of bytes of frames written (0 on failure)
+ */
+size_t
+encrypt_frames(struct credential_t * credentials, const char * commands,
+               const size_t * lengths, const uint32_t * requests,
+               unsigned char * frames, size_t count)
+{
+  size_t i, len, head, tag, written = 0;
+  struct frame_header_t header;
+  unsigned char iv[AUTH_IV_LENGTH], * frame;
+
+  if (!credentials
+   || (!credentials->cipher && rekey_credentials(credentials))) {
+    return 0;
+  }
+  tag = suite_is_aead(credentials->suite) ? AUTH_TAG_LENGTH : 0;
+  if (!credentials->framing && !tag) {
+    return gcry_cipher_encrypt(credentials->cipher,
+                               frames, count * MAX_COMMAND_LENGTH,
+                               (const unsigned char *)(commands),
+                               count * MAX_COMMAND_LENGTH)
+           ? 0 : count * MAX_COMMAND_LENGTH;
+  }
+  header.version = credentials->framing;
+  header.type = (credentials->role == ROLE_BANK) ? FRAME_REPLY
+                                                 : FRAME_REQUEST;
+  for (i = 0; i < count; ++i) {
+    frame = frames + written;
+    len = MAX_COMMAND_LENGTH;
+    head = 0;
+    if (credentials->framing) {
+      len = padded_length(lengths ? lengths[i] : 0);
+      header.length = (uint16_t)(len + tag);
+      header.sequence = (uint32_t)(credentials->sent);
+      header.request = requests ? requests[i] : header.sequence;
+      head = write_frame_header(frame, &header);
+      frame += head;
+    }
+    if (tag) {
+      frame_iv(iv, credentials->role, credentials->sent);
+      gcry_cipher_setiv(credentials->cipher, iv, AUTH_IV_LENGTH);
+      if (head) {
+        gcry_cipher_authenticate(credentials->cipher, frame - head, head);
+      }
+      gcry_cipher_final(credentials->cipher);
+    }
+    ++credentials->sent;
+    gcry_cipher_encrypt(credentials->cipher, frame, len,
+                        (const unsigned char *)(commands), len);
+    if (tag) {
+      gcry_cipher_gettag(credentials->cipher, frame + len, tag);
+    }
+    written = (size_t)(frame + len + tag - frames);
+    commands += MAX_COMMAND_LENGTH;
+  }
+  return written;
+}
+
+/*! \brief Decrypt count frames (back to back) into commands, as above
+ *
+ *  A frame whose header is not the next one expected from the other end
+ *  (by version, type, length or sequence) is no more authentic than one
+ *  whose tag does not match. Whatever of a command did not arrive (since
+ *  its frame was shorter) is cleared.
+ *
+ *  \param lengths  Set to the bytes of each command that arrived (if not
+ *                  NULL, and even for the last, should it not be authentic)
+ *  \param requests Set to the request each frame names (if not NULL)
+ *  \return         The number of frames decrypted before the first that was
+ *                  not authentic (whose command is cleared, and after which
+ *                  nothing more is decrypted)
+ */
+size_t
+decrypt_frames(struct credential_t * credentials,
+               const unsigned char * frames, char * commands,
+               size_t * lengths, uint32_t * requests, size_t count)
+{
+  size_t i, len, head, tag;
+  struct frame_header_t header;
+  unsigned char iv[AUTH_IV_LENGTH];
+  enum session_role_t sender;
+
+  if (!credentials
+   || (!credentials->cipher && rekey_credentials(credentials))) {
+    return 0;
+  }
+  tag = suite_is_aead(credentials->suite) ? AUTH_TAG_LENGTH : 0;
+  if (!credentials->framing && !tag) {
+    for (i = 0; i < count; ++i) {
+      if (lengths) {
+        lengths[i] = MAX_COMMAND_LENGTH;
+      }
+      if (requests) {
+        requests[i] = (uint32_t)(credentials->received + i);
+      }
+    }
+    return gcry_cipher_decrypt(credentials->cipher,
+                               (unsigned char *)(commands),
+                               count * MAX_COMMAND_LENGTH,
+                               frames, count * MAX_COMMAND_LENGTH)
+           ? 0 : count;
+  }
+  sender = (credentials->role == ROLE_BANK) ? ROLE_ATM : ROLE_BANK;
+  for (i = 0; i < count; ++i) {
+    len = MAX_COMMAND_LENGTH;
+    head = 0;
+    header.request = (uint32_t)(credentials->received);
+    if (credentials->framing) {
+      head = read_frame_header(frames, &header);
+      len = (header.length >= tag) ? header.length - tag : 0;
+      if (header.version != credentials->framing
+       || header.type != ((sender == ROLE_BANK) ? FRAME_REPLY
+                                                : FRAME_REQUEST)
+       || header.sequence != (uint32_t)(credentials->received)
+       || padded_length(len) != len) {
+        memset(commands, '\0', MAX_COMMAND_LENGTH);
+        return i;
+      }
+      frames += head;
+    }
+    if (tag) {
+      frame_iv(iv, sender, credentials->received);
+      gcry_cipher_setiv(credentials->cipher, iv, AUTH_IV_LENGTH);
+      if (head) {
+        gcry_cipher_authenticate(credentials->cipher, frames - head, head);
+      }
+      gcry_cipher_final(credentials->cipher);
+    }
+    ++credentials->received;
+    memset(commands + len, '\0', MAX_COMMAND_LENGTH - len);
+    gcry_cipher_decrypt(credentials->cipher,
+                        (unsigned char *)(commands), len, frames, len);
+    if (lengths) {
+      lengths[i] = len;
+    }
+    if (requests) {
+      requests[i] = header.request;
+    }
+    if (tag && gcry_cipher_checktag(credentials->cipher,
+                                    frames + len, tag)) {
+      memset(commands, '\0', MAX_COMMAND_LENGTH);
+      return i;
+    }
+    frames += len + tag;
+    commands += MAX_COMMAND_LENGTH;
+  }
+  return count;
+}
+
+/*! \brief As encrypt_message, but with the session cipher
+ *
+ *  Afterward, plength is the bytes of pbuffer that were sent.
+ */
+void
+encrypt_session(struct buffet_t * buffet, struct credential_t * credentials)
+{
+  size_t len;
+
+  if (buffet && (len = encrypt_frames(credentials, buffet->pbuffer,
+                                      &buffet->plength, &buffet->prequest,
+                                      buffet->cbuffer, 1))) {
+    buffet->framelength = len;
+    buffet->plength = credentials->framing
+                    ? padded_length(buffet->plength) : MAX_COMMAND_LENGTH;
+  }
+}
+
+/*! \brief As decrypt_message, but with the session cipher
+ *
+ *  \return BANKING_FAILURE if the frame was not authentic (in which case
+ *          tbuffer is cleared), otherwise BANKING_SUCCESS
+ */
+inline int
+decrypt_session(struct buffet_t * buffet,
+                struct credential_t * credentials) {
+  return (buffet && decrypt_frames(credentials, buffet->cbuffer,
+                                   buffet->tbuffer, &buffet->tlength,
+                                   &buffet->trequest, 1) == 1)
+         ? BANKING_SUCCESS : BANKING_FAILURE;
+}
+
+/*! \brief Whether each request proves its own freshness
+ *
+ *  Under a suite with tags, and framing since FRAME_VERSION_PROOF, every
+ *  request is sealed along with its header, whose sequence must be the
+ *  next expected (see decrypt_frames). One that is authentic is thus from
+ *  the live session (and not replayed), so the probe that once went ahead
+ *  of each command (see verify_session, in atm.c) is only a round trip.
+ */
+inline int
+self_proving(const struct credential_t * credentials) {
+  return credentials->framing >= FRAME_VERSION_PROOF
+      && suite_is_aead(credentials->suite);
+}
+
+/*! \brief Fill pbuffer with the session key and suite (keystore locked)
+ *
+ *  The whole key is copied (it is binary, so may well contain NULs), then
+ *  the suite behind AUTH_SUITE_MSG, and the remainder is nonce.
+ */
+void
+pack_credentials(struct buffet_t * buffet, struct credential_t * credentials)
+{
+  char * suite = buffet->pbuffer + AUTH_KEY_LENGTH;
+
+  fill_nonce(buffet->pbuffer, MAX_COMMAND_LENGTH);
+  if (credentials->key) {
+    memcpy(buffet->pbuffer, credentials->key, AUTH_KEY_LENGTH);
+  }
+  memcpy(suite, AUTH_SUITE_MSG, sizeof(AUTH_SUITE_MSG));
+  suite[sizeof(AUTH_SUITE_MSG)] = (char)(credentials->suite);
+}
+
+/*** RESUMPTION TICKETS **************************************************/
+
+/*! \brief What the bank needs to resume a session it knows nothing of
+ *
+ *  A ticket is issued (see seal_ticket) to a client that has logged in,
+ *  sealed under a key only the bank holds, so the bank keeps no state for
+ *  it. With the ticket comes a secret, which both ends derive from the
+ *  session key (see ticket_secret) and which never crosses the wire. To
+ *  resume, the client presents the ticket and a nonce, the bank returns
+ *  a nonce of its own, and both derive a fresh session key from all three
+ *  (see resume_credentials), so even resumptions of one ticket never share
+ *  a key, and no counter need survive from the session before.
+ *
+ *  Sealed, a ticket is an IV, the encrypted body, then the tag. The body
+ *  holds (in order) when the ticket expires (eight bytes, big-endian), the
+ *  suite, the framing, the username's length, the secret, then the
+ *  username itself.
+ */
+enum ticket_layout_t {
+  TICKET_EXPIRES  = 0,
+  TICKET_SUITE    = 8,
+  TICKET_FRAMING  = 9,
+  TICKET_USERLEN  = 10,
+  TICKET_SECRET   = 11,
+  TICKET_USERNAME = 11 + AUTH_KEY_LENGTH,
+  TICKET_BODY     = AUTH_TICKET_LENGTH - AUTH_IV_LENGTH - AUTH_TAG_LENGTH
+};
+
+/*! \brief The contents of an opened ticket */
+struct ticket_t {
+  time_t expires;
+  enum cipher_suite_t suite;
+  unsigned char framing;
+  size_t userlength;
+  unsigned char secret[AUTH_KEY_LENGTH];
+  char username[MAX_COMMAND_LENGTH];
+};
+
+/*! \brief The key tickets are sealed under (NULL if none are issued) */
+struct ticket_store_t {
+  unsigned char * key;
+  enum cipher_suite_t suite;
+} tickets;
+
+/*! \brief Generate the ticket key, under our favorite AEAD suite
+ *
+ *  Tickets outlive no restart of the bank, since the key is never saved.
+ */
+int
+init_tickets(void)
+{
+  size_t i;
+
+  for (i = 0; preferred_suites[i] != SUITE_NONE
+           && !suite_is_aead(preferred_suites[i]); ++i);
+  if (preferred_suites[i] == SUITE_NONE) {
+    fprintf(stderr, "WARNING: no suite to seal tickets, none issued\n");
+    return BANKING_FAILURE;
+  }
+  if (!(tickets.key = generate_key())) {
+    fprintf(stderr, "ERROR: unable to generate ticket key\n");
+    return BANKING_FAILURE;
+  }
+  tickets.suite = (enum cipher_suite_t)(preferred_suites[i]);
+  #ifndef NDEBUG
+  fprintf(stderr, "INFO: issuing tickets sealed with %s\n",
+          suite_name(tickets.suite));
+  #endif
+  return BANKING_SUCCESS;
+}
+
+inline void
+release_tickets(void) {
+  free_slot(&keystore.slabs, tickets.key);
+  tickets.key = NULL;
+}
+
+/*! \brief Where tickets are offered, after the suite (see pack_credentials)
+ *
+ *  Older ATMs never look here, and older banks leave only nonce.
+ */
+inline char *
+ticket_offer(char * buffer) {
+  return buffer + AUTH_KEY_LENGTH + sizeof(AUTH_SUITE_MSG) + 1;
+}
+
+/*! \brief Where framing is offered at "hello", after the ATM's suites */
+inline char *
+hello_framing(char * buffer) {
+  return buffer + sizeof(AUTH_CHECK_MSG) + sizeof(AUTH_SUITE_MSG)
+                + AUTH_SUITE_COUNT + 1;
+}
+
+/*! \brief Where the bank repeats it, after any ticket offer */
+inline char *
+reply_framing(char * buffer) {
+  return ticket_offer(buffer) + sizeof(AUTH_TICKET_MSG);
+}
+
+/*! \brief The secret that comes with a ticket (keystore locked) */
+inline int
+ticket_secret(unsigned char * secret, struct credential_t * credentials) {
+  return credentials->key
+       ? compute_digest(secret, credentials->key, AUTH_KEY_LENGTH,
+                        AUTH_TICKET_MSG, sizeof(AUTH_TICKET_MSG))
+       : BANKING_FAILURE;
+}
+
+/*! \brief Seal a ticket for the session (keystore locked) */
+int
+seal_ticket(unsigned char * ticket, struct credential_t * credentials)
+{
+  int i, status;
+  uint64_t expires;
+  gcry_cipher_hd_t handle;
+  unsigned char body[TICKET_BODY];
+
+  if (!tickets.key || !credentials->userlength
+   || credentials->userlength > TICKET_BODY - TICKET_USERNAME) {
+    return BANKING_FAILURE;
+  }
+  memset(body, '\0', TICKET_BODY);
+  expires = (uint64_t)(time(NULL) + AUTH_TICKET_TIMEOUT);
+  for (i = TICKET_SUITE - 1; i >= TICKET_EXPIRES; --i) {
+    body[i] = (unsigned char)(expires & 0xFF);
+    expires >>= 8;
+  }
+  body[TICKET_SUITE] = (unsigned char)(credentials->suite);
+  body[TICKET_FRAMING] = credentials->framing;
+  body[TICKET_USERLEN] = (unsigned char)(credentials->userlength);
+  memcpy(body + TICKET_USERNAME, credentials->username,
+         credentials->userlength);
+  if (ticket_secret(body + TICKET_SECRET, credentials)
+   || open_suite(&handle, tickets.suite, GCRY_CIPHER_SECURE)) {
+    wipe_bytes(body, TICKET_BODY);
+    return BANKING_FAILURE;
+  }
+  fill_nonce(ticket, AUTH_IV_LENGTH);
+  status = gcry_cipher_setkey(handle, tickets.key, AUTH_KEY_LENGTH)
+        || gcry_cipher_setiv(handle, ticket, AUTH_IV_LENGTH)
+        || gcry_cipher_final(handle)
+        || gcry_cipher_encrypt(handle, ticket + AUTH_IV_LENGTH,
+                               TICKET_BODY, body, TICKET_BODY)
+        || gcry_cipher_gettag(handle, ticket + AUTH_IV_LENGTH + TICKET_BODY,
+                              AUTH_TAG_LENGTH);
+  gcry_cipher_close(handle);
+  wipe_bytes(body, TICKET_BODY);
+  return status ? BANKING_FAILURE : BANKING_SUCCESS;
+}
+
+/*! \brief Open a ticket we sealed, unless it is forged or has expired */
+int
+open_ticket(const unsigned char * ticket, struct ticket_t * contents)
+{
+  int i, status;
+  uint64_t expires = 0;
+  gcry_cipher_hd_t handle;
+  unsigned char body[TICKET_BODY];
+
+  if (!tickets.key
+   || open_suite(&handle, tickets.suite, GCRY_CIPHER_SECURE)) {
+    return BANKING_FAILURE;
+  }
+  status = gcry_cipher_setkey(handle, tickets.key, AUTH_KEY_LENGTH)
+        || gcry_cipher_setiv(handle, ticket, AUTH_IV_LENGTH)
+        || gcry_cipher_final(handle)
+        || gcry_cipher_decrypt(handle, body, TICKET_BODY,
+                               ticket + AUTH_IV_LENGTH, TICKET_BODY)
+        || gcry_cipher_checktag(handle,
+                                ticket + AUTH_IV_LENGTH + TICKET_BODY,
+                                AUTH_TAG_LENGTH);
+  gcry_cipher_close(handle);
+  for (i = TICKET_EXPIRES; i < TICKET_SUITE; ++i) {
+    expires = expires << 8 | body[i];
+  }
+  memset(contents, '\0', sizeof(struct ticket_t));
+  contents->expires = (time_t)(expires);
+  contents->suite = (enum cipher_suite_t)(body[TICKET_SUITE]);
+  contents->framing = body[TICKET_FRAMING];
+  contents->userlength = body[TICKET_USERLEN];
+  if (status || contents->expires <= time(NULL)
+   || !suite_supported(contents->suite)
+   || contents->framing > FRAME_VERSION
+   || !contents->userlength
+   || contents->userlength > TICKET_BODY - TICKET_USERNAME) {
+    wipe_bytes(body, TICKET_BODY);
+    wipe_bytes(contents, sizeof(struct ticket_t));
+    return BANKING_FAILURE;
+  }
+  memcpy(contents->secret, body + TICKET_SECRET, AUTH_KEY_LENGTH);
+  memcpy(contents->username, body + TICKET_USERNAME, contents->userlength);
+  wipe_bytes(body, TICKET_BODY);
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Spread a ticket over two messages, after head bytes of the first
+ *
+ *  A ticket does not fit in one message (along with a marker), so it is
+ *  carried by two in a row, in either direction.
+ */
+inline void
+split_ticket(const unsigned char * ticket, char * first, char * second,
+             size_t head) {
+  memcpy(first + head, ticket, MAX_COMMAND_LENGTH - head);
+  memcpy(second, ticket + MAX_COMMAND_LENGTH - head,
+         AUTH_TICKET_LENGTH - (MAX_COMMAND_LENGTH - head));
+}
+
+/*! \brief Reassemble a ticket spread by split_ticket */
+inline void
+join_ticket(unsigned char * ticket, const char * first, const char * second,
+            size_t head) {
+  memcpy(ticket, first + head, MAX_COMMAND_LENGTH - head);
+  memcpy(ticket + MAX_COMMAND_LENGTH - head, second,
+         AUTH_TICKET_LENGTH - (MAX_COMMAND_LENGTH - head));
+}
+
+/*! \brief Attach the key that a ticket's secret and both nonces derive,
+ *         then key the session cipher (the suite must be set already)
+ *
+ *  \param nonces The client's nonce, then the bank's (AUTH_NONCE_LENGTH
+ *                bytes apiece)
+ */
+int
+resume_credentials(struct credential_t * credentials,
+                   const unsigned char * secret,
+                   const unsigned char * nonces)
+{
+  gcry_md_hd_t handle;
+  unsigned char key[AUTH_DIGEST_LENGTH];
+
+  if (!(handle = begin_digest(secret, AUTH_KEY_LENGTH))) {
+    return BANKING_FAILURE;
+  }
+  update_digest(handle, AUTH_RESUME_MSG, sizeof(AUTH_RESUME_MSG));
+  update_digest(handle, nonces, 2 * AUTH_NONCE_LENGTH);
+  finish_digest(handle, key);
+  /* Attaching copies the key into a slot of its own */
+  credentials->key = key;
+  if (attach_key(&credentials->key)) {
+    credentials->key = NULL;
+  }
+  wipe_bytes(key, AUTH_DIGEST_LENGTH);
+  return credentials->key ? rekey_credentials(credentials)
+                          : BANKING_FAILURE;
+}
+
 /*** UTILITY FUNCTIONS ***************************************************/
 
 /*! \brief Print a labeled hex-formated representation of a string
@@ -396,92 +1835,99 @@ salt_and_pepper(char * msg, const char * salt, struct buffet_t * buffet)
 
   /* Make sure the message is peppered with nonce */
   if (++mlen < MAX_COMMAND_LENGTH) {
-    gcry_create_nonce(buffet->pbuffer + mlen, MAX_COMMAND_LENGTH - mlen);
+    fill_nonce(buffet->pbuffer + mlen, MAX_COMMAND_LENGTH - mlen);
   }
+  /* Variable frames need carry only the message (and its terminator) */
+  buffet->plength = (mlen < MAX_COMMAND_LENGTH) ? mlen : MAX_COMMAND_LENGTH;
 }
 
-/*! \brief Produce the message digest of a banking command TODO SIMPLIFY
+/*! \brief Like salt_and_pepper, but for a binary message (no terminator)
  *
- *  \param cmd    The command to checksum
+ *  \return BANKING_SUCCESS, or BANKING_FAILURE if the message is too long
+ */
+int
+pepper_message(const struct message_t * message, struct buffet_t * buffet)
+{
+  size_t mlen;
+
+  if (!(mlen = write_message((unsigned char *)(buffet->pbuffer), message))) {
+    return BANKING_FAILURE;
+  }
+  fill_nonce(buffet->pbuffer + mlen, MAX_COMMAND_LENGTH - mlen);
+  buffet->plength = mlen;
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Produce the message digest of a banking command
+ *
+ *  \param cmd    The command to checksum (up to its NUL, if any)
  *  \param digest If non-NULL, check this against the hash of cmd
- *  \param buffer If NULL, hash to a temporary array
- *                If points to NULL, malloc space for the hash here
- *                Otherwise, buffer is assumed to be appropriate
+ *  \param buffer If non-NULL, receives the hash (AUTH_DIGEST_LENGTH bytes)
  *  \return       0 if cmd hashes to digest, non-zero otherwise
  */
 int
-checksum(char * cmd, unsigned char * digest, unsigned char ** buffer)
+checksum(const char * cmd, const unsigned char * digest,
+         unsigned char * buffer)
 {
-  unsigned char * temporary;
   int status;
-  size_t len;
-
-  temporary = NULL;
-  status = BANKING_SUCCESS;
-  len = gcry_md_get_algo_dlen(GCRY_MD_SHA256);
+  unsigned char temporary[AUTH_DIGEST_LENGTH];
 
-  /* Behavior is dependent upon the status of arguments
-   * If buffer is NULL, cmd is hashed to a temporary array
-   * If buffer points to a NULL, allocate space for the hash here
-   * Otherwise, buffer is assumed to provide a reasonable buffer
-   */
-  if (buffer == NULL) {
-    temporary = malloc(len);
-    buffer = &temporary;
-  } else if (*buffer == NULL) {
-    *buffer = malloc(len);
+  /* Without a buffer, hash to a temporary array */
+  if (!buffer) {
+    buffer = temporary;
+  }
+  if (compute_digest(buffer, NULL, 0,
+                     cmd, strnlen(cmd, MAX_COMMAND_LENGTH))) {
+    return BANKING_FAILURE;
   }
-
-  /* Try to take the hash of the command and buffer it */
-  gcry_md_hash_buffer(GCRY_MD_SHA256, *buffer,
-                                      (const void *)(cmd),
-                                      MAX_COMMAND_LENGTH);
 
   /* If a digest value was given, check it */
+  status = digest ? compare_digests(buffer, digest, AUTH_DIGEST_LENGTH)
+                  : BANKING_SUCCESS;
+  #ifndef NDEBUG
+  fprintf(stderr, "INFO: sha256sum('%s')", cmd);
   if (digest) {
-    status = strncmp((char *)(*buffer), (char *)(digest), len);
-    #ifndef NDEBUG
-    fprintf(stderr, "INFO: sha256sum('%s')", cmd);
-    fprintx(stderr, " ?", digest, len);
+    fprintx(stderr, " ?", (unsigned char *)(digest), AUTH_DIGEST_LENGTH);
     if (status) {
-      fprintf(stderr, "ERROR: hash mismatch (%i) ", status);
-      fprintx(stderr, "HASH =", *buffer, len);
+      fprintf(stderr, "ERROR: hash mismatch ");
+      fprintx(stderr, "HASH =", buffer, AUTH_DIGEST_LENGTH);
     }
   } else {
-    fprintf(stderr, "INFO: sha256sum('%s')", cmd);
-    fprintx(stderr, " =", *buffer, len);
-    #endif
-  }
-
-  /* If a temporary buffer was allocated, release it */
-  if (temporary) {
-    free(temporary);
+    fprintx(stderr, " =", buffer, AUTH_DIGEST_LENGTH);
   }
+  #endif
+  wipe_bytes(temporary, AUTH_DIGEST_LENGTH);
   return status;
 }
 
 void
 print_keystore(FILE * fp, const char * label)
 {
+  size_t i;
   struct key_list_t * current;
 
+  lock_keystore();
   fprintf(fp, "KEYSTORE (%s) (SEED: '%s') [TTL: %li/%li] CREATED: %s",
     label, keystore.key,
     (long)(keystore.expires - time(NULL)),
     (long)(keystore.expires - keystore.issued),
     ctime(&keystore.issued));
+  fprintf(fp, "\t%lu KEY(S) IN %lu BUCKETS, %lu SLAB(S)%s\n",
+    (unsigned long)(keystore.count), (unsigned long)(keystore.size),
+    (unsigned long)(keystore.slabs.count),
+    keystore.slabs.locked ? "" : " (UNLOCKED)");
+  #ifdef USING_PTHREADS
+  fprintf(fp, "\t%lu KEY(S) QUEUED\n", (unsigned long)(keystore.depth));
+  #endif
 
-  current = keystore.next;
-  while (current) {
-    if (current->key) {
+  for (i = 0; i < keystore.size; ++i) {
+    for (current = keystore.buckets[i]; current; current = current->next) {
       fprintx(fp, "\tENTRY", current->key, AUTH_KEY_LENGTH);
       fprintf(fp, "\t\tEXPIRES: %s", ctime(&current->expires));
-    } else {
-      fprintf(fp, "\tENTRY REVOKED\n");
+      fprintf(fp, "\t\tISSUED:  %s", ctime(&current->issued));
     }
-    fprintf(fp, "\t\tISSUED:  %s", ctime(&current->issued));
-    current = current->next;
   }
+  unlock_keystore();
 
   fprintf(fp, "\n");
 }
@@ -492,7 +1938,7 @@ test_crypto()
 {
   char * msg;
   struct buffet_t buffet;
-  unsigned char * key, * md;
+  unsigned char * key, md[AUTH_DIGEST_LENGTH];
 
   msg = calloc(MAX_COMMAND_LENGTH, sizeof(char));
   strncpy(msg, AUTH_CHECK_MSG, sizeof(AUTH_CHECK_MSG));
@@ -526,8 +1972,7 @@ test_crypto()
   print_keystore(stderr, "after revocation");
 
   /* checksum test */
-  md = NULL;
-  if (checksum(msg, NULL, &md)) {
+  if (checksum(msg, NULL, md)) {
     fprintf(stderr, "ERROR: cannot checksum message\n");
   }
   if (checksum(msg, md, NULL)) {
@@ -537,7 +1982,8 @@ test_crypto()
   }
 
   /* cleanup */
-  free(md);
+  release_digests();
+  release_default_cipher();
   free(msg);
 
   return BANKING_SUCCESS;
@@ -20,26 +20,319 @@
 #define DB_UTILS_H
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 /* TODO ^ this is only needed for unlink, remove it? */
 
+#include <pthread.h>
+
 #include "sqlite3.h"
 
 #include "banking_constants.h"
+#include "cache_utils.h"
+
+/*** STATEMENT CACHE *****************************************************/
+
+enum db_statement_id_t {
+  DB_LOOKUP_BALANCE,
+  DB_LOOKUP_PIN,
+  DB_UPDATE_BALANCE,
+  DB_DEBIT_BALANCE,
+  DB_CREDIT_BALANCE,
+  DB_BEGIN,
+  DB_COMMIT,
+  DB_ROLLBACK,
+  DB_SAVEPOINT,
+  DB_RELEASE,
+  DB_ROLLBACK_TO,
+  DB_STATEMENT_COUNT
+};
+
+/* Indexed by the identifiers above */
+const char * const db_statement_sql[DB_STATEMENT_COUNT] = {
+  SQL_CMD_LOOKUP_BALANCE,
+  SQL_CMD_LOOKUP_PIN,
+  SQL_CMD_UPDATE_BALANCE,
+  SQL_CMD_DEBIT_BALANCE,
+  SQL_CMD_CREDIT_BALANCE,
+  SQL_CMD_BEGIN,
+  SQL_CMD_COMMIT,
+  SQL_CMD_ROLLBACK,
+  SQL_CMD_SAVEPOINT,
+  SQL_CMD_RELEASE,
+  SQL_CMD_ROLLBACK_TO
+};
+
+/*! \brief A connection and the statements prepared against it
+ *
+ *  Each query is parsed and planned the first time it is run on a given
+ *  connection, then reset and rebound on every later run (see
+ *  fetch_statement). Like the connection, a handle is never shared. The
+ *  account cache, if any, is shared by every handle to the database.
+ */
+struct db_handle_t {
+  sqlite3 * conn;
+  struct account_cache_t * cache;
+  sqlite3_stmt * statements[DB_STATEMENT_COUNT];
+  const char * residues[DB_STATEMENT_COUNT];
+};
+
+/*! \brief Obtain a ready-to-bind statement, preparing it if need be
+ *
+ *  \param residue If non-NULL, set to whatever followed the SQL statement
+ *  \return        NULL if the statement could not be prepared
+ */
+sqlite3_stmt *
+fetch_statement(struct db_handle_t * db_conn, enum db_statement_id_t id,
+                const char ** residue)
+{
+  int status;
+
+  if (!db_conn->statements[id]) {
+    status = sqlite3_prepare_v2(db_conn->conn,
+                                db_statement_sql[id], -1,
+                                &db_conn->statements[id],
+                                &db_conn->residues[id]);
+    if (status != SQLITE_OK) {
+      #ifndef NDEBUG
+      fprintf(stderr,
+              "ERROR: unable to prepare statement %i [code %i]\n",
+              (int)(id), status);
+      #endif
+      sqlite3_finalize(db_conn->statements[id]);
+      db_conn->statements[id] = NULL;
+      return NULL;
+    }
+  }
+  if (residue) {
+    *residue = db_conn->residues[id];
+  }
+  return db_conn->statements[id];
+}
+
+/*! \brief Make a fetched statement reusable (and release its locks) */
+inline void
+release_statement(sqlite3_stmt * statement) {
+  /* A statement left mid-step would hold its read transaction open */
+  sqlite3_reset(statement);
+  sqlite3_clear_bindings(statement);
+}
+
+/*** INITIALIZATION AND TERMINATION **************************************/
+
+/*! \brief Open a connection for use by one thread at a time
+ *
+ *  Connections are opened without SQLite's own mutexes (callers never
+ *  share one between threads) and wait up to DB_BUSY_TIMEOUT for locks.
+ */
+int
+open_db(const char * db_path, struct db_handle_t * db_conn)
+{
+  memset(db_conn, '\0', sizeof(struct db_handle_t));
+  if (sqlite3_open_v2(db_path, &db_conn->conn, SQLITE_OPEN_READWRITE
+                                             | SQLITE_OPEN_CREATE
+                                             | SQLITE_OPEN_NOMUTEX, NULL)
+   != SQLITE_OK) {
+    fprintf(stderr, "ERROR: unable to open database\n");
+    sqlite3_close(db_conn->conn);
+    db_conn->conn = NULL;
+    return BANKING_FAILURE;
+  }
+  sqlite3_busy_timeout(db_conn->conn, DB_BUSY_TIMEOUT);
+  return BANKING_SUCCESS;
+}
 
 void
-destroy_db(const char * db_path, sqlite3 * db_conn)
+destroy_db(const char * db_path, struct db_handle_t * db_conn)
 {
-  if (sqlite3_close(db_conn) != SQLITE_OK) {
+  size_t i;
+
+  /* Cached statements would keep the connection from closing */
+  for (i = 0; i < DB_STATEMENT_COUNT; ++i) {
+    sqlite3_finalize(db_conn->statements[i]);
+    db_conn->statements[i] = NULL;
+  }
+  if (sqlite3_close(db_conn->conn) != SQLITE_OK) {
     fprintf(stderr, "ERROR: unable to close database\n");
   }
+  db_conn->conn = NULL;
   if (db_path && unlink(db_path)) {
     fprintf(stderr, "WARNING: unable to delete database\n");
   }
 }
 
+/*! \brief Name each account whose name_key another account shares
+ *
+ *  Older versions told names apart by case, so a table they wrote may hold
+ *  names that the unique index on name_key cannot: these must be renamed
+ *  (both name and name_key) or removed, by hand, before the bank starts.
+ *
+ *  \return The number of such accounts
+ */
 int
-init_db(const char * db_path, sqlite3 ** db_conn)
+report_duplicate_keys(sqlite3 * db_conn)
+{
+  sqlite3_stmt * statement;
+  int status, duplicates;
+
+  duplicates = 0;
+  status = sqlite3_prepare_v2(db_conn,
+                              SQL_CMD_DUPLICATE_KEYS,
+                              sizeof(SQL_CMD_DUPLICATE_KEYS),
+                              &statement,
+                              NULL);
+  if (status == SQLITE_OK) {
+    while ((status = sqlite3_step(statement)) == SQLITE_ROW) {
+      fprintf(stderr,
+              "ERROR: account '%s' shares its key ('%s') with another\n",
+              (const char *)(sqlite3_column_text(statement, 0)),
+              (const char *)(sqlite3_column_text(statement, 1)));
+      ++duplicates;
+    }
+  }
+  sqlite3_finalize(statement);
+  return duplicates;
+}
+
+/*! \brief Bring an existing accounts table up to the current schema
+ *
+ *  Adds and fills the name_key column if it is missing, then ensures the
+ *  unique index on it exists. Names written by older versions may carry
+ *  their terminator, which the key leaves out, and may differ only by case
+ *  (see report_duplicate_keys). A database with no accounts table is left
+ *  alone.
+ */
+int
+migrate_db(sqlite3 * db_conn)
+{
+  sqlite3_stmt * statement;
+  const char * column;
+  int status, columns, has_key;
+
+  columns = has_key = 0;
+  status = sqlite3_prepare_v2(db_conn,
+                              SQL_CMD_TABLE_INFO,
+                              sizeof(SQL_CMD_TABLE_INFO),
+                              &statement,
+                              NULL);
+  if (status == SQLITE_OK) {
+    /* Each row describes one column, whose name is the second field */
+    while ((status = sqlite3_step(statement)) == SQLITE_ROW) {
+      column = (const char *)(sqlite3_column_text(statement, 1));
+      if (column && !strcmp(column, "name_key")) {
+        has_key = 1;
+      }
+      ++columns;
+    }
+  }
+  sqlite3_finalize(statement);
+  if (status != SQLITE_DONE) {
+    fprintf(stderr,
+            "ERROR: unable to inspect accounts table [code %i]\n",
+            status);
+    return BANKING_FAILURE;
+  }
+  if (!columns) {
+    return BANKING_SUCCESS;
+  }
+
+  if (!has_key) {
+    #ifndef NDEBUG
+    fprintf(stderr, "INFO: adding name_key to accounts table\n");
+    #endif
+    status = sqlite3_exec(db_conn, SQL_CMD_MIGRATE_KEYS, NULL, NULL, NULL);
+    if (status != SQLITE_OK) {
+      fprintf(stderr,
+              "ERROR: unable to migrate accounts table [code %i]\n",
+              status);
+      sqlite3_exec(db_conn, SQL_CMD_ROLLBACK, NULL, NULL, NULL);
+      return BANKING_FAILURE;
+    }
+  }
+
+  /* This fails if two names differ only by case */
+  status = sqlite3_exec(db_conn, SQL_CMD_CREATE_INDEX, NULL, NULL, NULL);
+  if (status != SQLITE_OK) {
+    fprintf(stderr,
+            "ERROR: unable to index accounts table [code %i]\n",
+            status);
+    if (status == SQLITE_CONSTRAINT && report_duplicate_keys(db_conn)) {
+      fprintf(stderr,
+              "ERROR: names must differ by more than case (rename or "
+              "remove the accounts above)\n");
+    }
+    return BANKING_FAILURE;
+  }
+
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Fill the account cache from the accounts table */
+int
+load_cache(struct db_handle_t * db_conn, struct account_cache_t * cache)
+{
+  sqlite3_stmt * statement;
+  size_t accounts;
+  int status;
+
+  /* Size the table by the number of accounts */
+  status = sqlite3_prepare_v2(db_conn->conn,
+                              SQL_CMD_COUNT_ACCOUNTS,
+                              sizeof(SQL_CMD_COUNT_ACCOUNTS),
+                              &statement,
+                              NULL);
+  if (status == SQLITE_OK
+   && (status = sqlite3_step(statement)) == SQLITE_ROW) {
+    accounts = (size_t)(sqlite3_column_int64(statement, 0));
+    status = SQLITE_OK;
+  }
+  sqlite3_finalize(statement);
+  if (status != SQLITE_OK || init_account_cache(cache, accounts)) {
+    fprintf(stderr, "WARNING: unable to size account cache\n");
+    return BANKING_FAILURE;
+  }
+
+  status = sqlite3_prepare_v2(db_conn->conn,
+                              SQL_CMD_LOAD_ACCOUNTS,
+                              sizeof(SQL_CMD_LOAD_ACCOUNTS),
+                              &statement,
+                              NULL);
+  if (status == SQLITE_OK) {
+    while ((status = sqlite3_step(statement)) == SQLITE_ROW) {
+      /* Names that do not fit are left to SQLite */
+      insert_account(cache,
+                     (const char *)(sqlite3_column_text(statement, 0)),
+                     (size_t)(sqlite3_column_bytes(statement, 0)),
+                     (const char *)(sqlite3_column_text(statement, 1)),
+                     (size_t)(sqlite3_column_bytes(statement, 1)),
+                     sqlite3_column_int64(statement, 2));
+    }
+  }
+  sqlite3_finalize(statement);
+  if (status != SQLITE_DONE) {
+    fprintf(stderr, "WARNING: unable to load account cache\n");
+    destroy_account_cache(cache);
+    return BANKING_FAILURE;
+  }
+
+  #ifndef NDEBUG
+  fprintf(stderr, "INFO: cached %lu account(s) in %lu slots\n",
+          (unsigned long)(cache->count), (unsigned long)(cache->mask + 1));
+  #endif
+  db_conn->cache = cache;
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Open (and populate, or migrate) the database, then cache it
+ *
+ *  \param cache Filled with every account, unless NULL
+ */
+int
+init_db(const char * db_path, struct db_handle_t * db_conn,
+                              struct account_cache_t * cache)
 {
   size_t i;
   const char * residue;
@@ -48,15 +341,23 @@ init_db(const char * db_path, sqlite3 ** db_conn)
 
   return_status = BANKING_SUCCESS;
 
-  if (sqlite3_open(db_path, db_conn)) {
+  /* Connections must not be shared, but may be used from any thread */
+  if (open_db(db_path, db_conn) || !sqlite3_threadsafe()) {
     fprintf(stderr, "ERROR: unable to open database\n");
     return_status = BANKING_FAILURE;
   }
 
+  /* Write-ahead logging lets readers proceed alongside a writer */
+  if (return_status == BANKING_SUCCESS
+   && sqlite3_exec(db_conn->conn, SQL_CMD_JOURNAL_MODE,
+                   NULL, NULL, NULL) != SQLITE_OK) {
+    fprintf(stderr, "WARNING: unable to enable write-ahead logging\n");
+  }
+
   #ifdef BANKING_DB_INIT
-  /* Create the table with preliminary data */
+  /* Create the table, unless it exists */
   if (return_status == BANKING_SUCCESS) {
-    status = sqlite3_prepare_v2(*db_conn,
+    status = sqlite3_prepare_v2(db_conn->conn,
                                 SQL_CMD_CREATE_TABLE,
                                 sizeof(SQL_CMD_CREATE_TABLE),
                                 &statement,
@@ -77,9 +378,20 @@ init_db(const char * db_path, sqlite3 ** db_conn)
     }
     #endif /* NDEBUG */
   }
+  #endif /* BANKING_DB_INIT */
+
+  /* Files left by older versions may predate the indexed key (if they
+   * cannot be brought up to date, they are kept, to be put right) */
+  if (return_status == BANKING_SUCCESS && migrate_db(db_conn->conn)) {
+    return_status = BANKING_FAILURE;
+    db_path = NULL;
+  }
+
+  #ifdef BANKING_DB_INIT
+  /* Accounts already present (by key) are left as they are */
   if (return_status == BANKING_SUCCESS) {
     /* Prepare the insert statement */
-    status = sqlite3_prepare_v2(*db_conn,
+    status = sqlite3_prepare_v2(db_conn->conn,
                                 SQL_CMD_INSERT_ACCOUNT,
                                 sizeof(SQL_CMD_INSERT_ACCOUNT),
                                 &statement,
@@ -123,7 +435,7 @@ init_db(const char * db_path, sqlite3 ** db_conn)
   #ifndef NDEBUG
   /* Dump the initial contents of the database in debug mode */
   if (return_status == BANKING_SUCCESS) {
-    status = sqlite3_prepare_v2(*db_conn,
+    status = sqlite3_prepare_v2(db_conn->conn,
                                 SQL_CMD_SELECT_ALL,
                                 sizeof(SQL_CMD_SELECT_ALL),
                                 &statement,
@@ -147,36 +459,136 @@ init_db(const char * db_path, sqlite3 ** db_conn)
   }
   #endif /* NDEBUG */
 
+  /* Without a cache, every read simply goes to SQLite */
+  if (return_status == BANKING_SUCCESS && cache) {
+    load_cache(db_conn, cache);
+  }
+
   if (return_status != BANKING_SUCCESS) {
-    destroy_db(db_path, *db_conn);
+    destroy_db(db_path, db_conn);
     return BANKING_FAILURE;
   }
 
   return BANKING_SUCCESS;
 }
 
+/*** CONNECTION POOL *****************************************************/
+
+/*! \brief A set of connections to one database
+ *
+ *  The admin connection is reserved for the shell. The rest are checked out
+ *  by worker threads (see acquire_db), so no two threads share one, and
+ *  reads on different connections can proceed in parallel.
+ */
+struct db_pool_t {
+  struct account_cache_t cache;
+  struct db_handle_t admin, * handles, ** idle;
+  size_t size, available;
+  pthread_mutex_t mutex;
+};
+
+void
+destroy_db_pool(const char * db_path, struct db_pool_t * pool)
+{
+  size_t i;
+
+  /* Every connection should have been returned by now */
+  if (pool->available != pool->size) {
+    fprintf(stderr,
+            "WARNING: %lu database connection(s) not returned\n",
+            (unsigned long)(pool->size - pool->available));
+  }
+  for (i = 0; i < pool->size; ++i) {
+    destroy_db(NULL, &pool->handles[i]);
+  }
+  free(pool->handles);
+  free(pool->idle);
+  pool->handles = NULL;
+  pool->idle = NULL;
+  pool->size = pool->available = 0;
+  pthread_mutex_destroy(&pool->mutex);
+  /* The admin connection is last, since it may delete the database */
+  destroy_db(db_path, &pool->admin);
+  destroy_account_cache(&pool->cache);
+}
+
+/*! \brief Initialize the database, then open size more connections */
+int
+init_db_pool(const char * db_path, struct db_pool_t * pool, size_t size)
+{
+  pool->size = pool->available = 0;
+  memset(&pool->cache, '\0', sizeof(struct account_cache_t));
+  pthread_mutex_init(&pool->mutex, NULL);
+  pool->handles = calloc(size, sizeof(struct db_handle_t));
+  pool->idle = calloc(size, sizeof(struct db_handle_t *));
+  if (!pool->handles || !pool->idle
+   || init_db(db_path, &pool->admin, &pool->cache)) {
+    free(pool->handles);
+    free(pool->idle);
+    pool->handles = NULL;
+    pool->idle = NULL;
+    pthread_mutex_destroy(&pool->mutex);
+    return BANKING_FAILURE;
+  }
+  for (pool->size = size; pool->available < size; ++pool->available) {
+    if (open_db(db_path, &pool->handles[pool->available])) {
+      pool->size = pool->available;
+      destroy_db_pool(db_path, pool);
+      return BANKING_FAILURE;
+    }
+    pool->handles[pool->available].cache = pool->admin.cache;
+    pool->idle[pool->available] = &pool->handles[pool->available];
+  }
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Check out a connection for the calling thread (or NULL) */
+struct db_handle_t *
+acquire_db(struct db_pool_t * pool)
+{
+  struct db_handle_t * db_conn = NULL;
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->available) {
+    db_conn = pool->idle[--pool->available];
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return db_conn;
+}
+
+void
+release_db(struct db_pool_t * pool, struct db_handle_t * db_conn)
+{
+  if (db_conn) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->idle[pool->available++] = db_conn;
+    pthread_mutex_unlock(&pool->mutex);
+  }
+}
+
+/*** QUERIES *************************************************************/
+
 int
-do_check(sqlite3 * db_conn, const char ** residue,
+do_check(struct db_handle_t * db_conn, const char ** residue,
          char * name, size_t name_len,
          char * pin,  size_t  pin_len)
 {
   sqlite3_stmt * statement;
+  struct account_record_t * record;
   int status, return_status;
 
+  /* Cached accounts need not touch the database */
+  if ((record = find_account(db_conn->cache, name, name_len))) {
+    if (residue) {
+      *residue = "";
+    }
+    return pin ? check_pin(db_conn->cache, record, pin, pin_len)
+               : BANKING_SUCCESS;
+  }
+
   return_status = BANKING_SUCCESS;
 
-  /* Setup the system, which ensures cleanup runs */
-  status = sqlite3_prepare_v2(db_conn,
-                              SQL_CMD_LOOKUP_PIN,
-                              sizeof(SQL_CMD_LOOKUP_PIN),
-                              &statement,
-                              residue);
-  if (status != SQLITE_OK) {
-    #ifndef NDEBUG
-    fprintf(stderr,
-            "ERROR: unable to prepare lookup statement [code %i]\n",
-            status);
-    #endif
+  /* Fetch the cached statement, preparing it on first use */
+  if (!(statement = fetch_statement(db_conn, DB_LOOKUP_PIN, residue))) {
     return_status = BANKING_FAILURE;
   }
 
@@ -218,40 +630,26 @@ do_check(sqlite3 * db_conn, const char ** residue,
     }
   }
 
-  /* Always cleanup the statement */
-  status = sqlite3_finalize(statement);
-  #ifndef NDEBUG
-  if (status != SQLITE_OK) {
-    fprintf(stderr,
-            "WARNING: unable to finalize update statement [code %i]\n",
-            status);
+  /* Always reset the statement */
+  if (statement) {
+    release_statement(statement);
   }
-  #endif
 
   return return_status;
 }
 
+/*! \brief Look up a balance in SQLite itself, bypassing the cache */
 int
-do_lookup(sqlite3 * db_conn, const char ** residue,
-          char * name, size_t name_len, long int * balance)
+lookup_database(struct db_handle_t * db_conn, const char ** residue,
+                char * name, size_t name_len, long int * balance)
 {
   sqlite3_stmt * statement;
   int status, return_status;
 
   return_status = BANKING_SUCCESS;
 
-  /* Setup the system, which ensures cleanup runs */
-  status = sqlite3_prepare_v2(db_conn,
-                              SQL_CMD_LOOKUP_BALANCE,
-                              sizeof(SQL_CMD_LOOKUP_BALANCE),
-                              &statement,
-                              residue);
-  if (status != SQLITE_OK) {
-    #ifndef NDEBUG
-    fprintf(stderr,
-            "ERROR: unable to prepare lookup statement [code %i]\n",
-            status);
-    #endif
+  /* Fetch the cached statement, preparing it on first use */
+  if (!(statement = fetch_statement(db_conn, DB_LOOKUP_BALANCE, residue))) {
     return_status = BANKING_FAILURE;
   }
 
@@ -290,24 +688,39 @@ do_lookup(sqlite3 * db_conn, const char ** residue,
     }
   }
 
-  /* Always cleanup the statement */
-  status = sqlite3_finalize(statement);
-  #ifndef NDEBUG
-  if (status != SQLITE_OK) {
-    fprintf(stderr,
-            "WARNING: unable to finalize update statement [code %i]\n",
-            status);
+  /* Always reset the statement */
+  if (statement) {
+    release_statement(statement);
   }
-  #endif
 
   return return_status;
 }
 
 int
-do_update(sqlite3 * db_conn, const char ** residue,
+do_lookup(struct db_handle_t * db_conn, const char ** residue,
+          char * name, size_t name_len, long int * balance)
+{
+  struct account_record_t * record;
+
+  /* Cached accounts need not touch the database */
+  if ((record = find_account(db_conn->cache, name, name_len))) {
+    if (residue) {
+      *residue = "";
+    }
+    if (balance) {
+      *balance = (long int)(load_balance(record));
+    }
+    return BANKING_SUCCESS;
+  }
+  return lookup_database(db_conn, residue, name, name_len, balance);
+}
+
+int
+do_update(struct db_handle_t * db_conn, const char ** residue,
           char * name, size_t name_len, long int new_balance)
 {
   sqlite3_stmt * statement;
+  struct account_record_t * record;
   int status, return_status;
 
   /* Checking an update will demand a lookup */
@@ -318,17 +731,8 @@ do_update(sqlite3 * db_conn, const char ** residue,
   lookup_residue = NULL;
   return_status = BANKING_SUCCESS;
 
-  status = sqlite3_prepare_v2(db_conn,
-                              SQL_CMD_UPDATE_BALANCE,
-                              sizeof(SQL_CMD_UPDATE_BALANCE),
-                              &statement,
-                              residue);
-  if (status != SQLITE_OK) {
-    #ifndef NDEBUG
-    fprintf(stderr,
-            "ERROR: unable to prepare update statement [code %i]\n",
-            status);
-    #endif
+  /* Fetch the cached statement, preparing it on first use */
+  if (!(statement = fetch_statement(db_conn, DB_UPDATE_BALANCE, residue))) {
     return_status = BANKING_FAILURE;
   }
 
@@ -358,20 +762,22 @@ do_update(sqlite3 * db_conn, const char ** residue,
     }
   }
 
-  status = sqlite3_finalize(statement);
-  #ifndef NDEBUG
-  if (status != SQLITE_OK) {
-    fprintf(stderr,
-            "WARNING: unable to finalize update statement [code %i]\n",
-            status);
+  /* Always reset the statement */
+  if (statement) {
+    release_statement(statement);
+  }
+
+  /* Write through to the cache, once the database has the new balance */
+  if (return_status == BANKING_SUCCESS
+   && (record = find_account(db_conn->cache, name, name_len))) {
+    store_balance(record, new_balance);
   }
-  #endif
 
   #ifndef NDEBUG
-  /* Do a quick sanity check */
+  /* Do a quick sanity check (of SQLite, as the cache was just written) */
   if (return_status == BANKING_SUCCESS
-      && (   (status = do_lookup(db_conn, &lookup_residue,
-                                 name, name_len, &lookup_balance))
+      && (   (status = lookup_database(db_conn, &lookup_residue,
+                                       name, name_len, &lookup_balance))
           || lookup_balance != new_balance)) {
     fprintf(stderr,
             "WARNING: update failed sanity check [code %i]\n",
@@ -392,4 +798,346 @@ do_update(sqlite3 * db_conn, const char ** residue,
   return return_status;
 }
 
+/*** MONEY MOVEMENT ******************************************************/
+
+/*! \brief Run a statement that takes no parameters (e.g. DB_COMMIT) */
+int
+do_statement(struct db_handle_t * db_conn, enum db_statement_id_t id)
+{
+  sqlite3_stmt * statement;
+  int status;
+
+  if (!(statement = fetch_statement(db_conn, id, NULL))) {
+    return BANKING_FAILURE;
+  }
+  status = sqlite3_step(statement);
+  release_statement(statement);
+  #ifndef NDEBUG
+  if (status != SQLITE_DONE) {
+    fprintf(stderr,
+            "ERROR: unable to complete statement %i [code %i]\n",
+            (int)(id), status);
+  }
+  #endif
+
+  return (status == SQLITE_DONE) ? BANKING_SUCCESS : BANKING_FAILURE;
+}
+
+/*! \brief Apply a debit or credit (by id) to exactly one account
+ *
+ *  \return BANKING_FAILURE if no row changed (e.g. the account does not
+ *          exist, or a debit would overdraw it) or the statement failed
+ */
+int
+do_adjust(struct db_handle_t * db_conn, enum db_statement_id_t id,
+          char * name, size_t name_len, long int amount)
+{
+  sqlite3_stmt * statement;
+  int status, return_status;
+
+  return_status = BANKING_SUCCESS;
+
+  if (!(statement = fetch_statement(db_conn, id, NULL))) {
+    return BANKING_FAILURE;
+  }
+
+  if (   (status = sqlite3_bind_int64(statement, 1,
+                                      amount)) != SQLITE_OK
+      || (status = sqlite3_bind_text (statement, 2,
+                                      name, name_len,
+                                      SQLITE_STATIC)) != SQLITE_OK) {
+    #ifndef NDEBUG
+    fprintf(stderr,
+            "ERROR: unable to bind adjustment parameters [code %i]\n",
+            status);
+    #endif
+    return_status = BANKING_FAILURE;
+  }
+
+  if (return_status == BANKING_SUCCESS) {
+    status = sqlite3_step(statement);
+    if (status != SQLITE_DONE) {
+      #ifndef NDEBUG
+      fprintf(stderr,
+              "ERROR: unable to complete adjustment [code %i]\n",
+              status);
+      #endif
+      return_status = BANKING_FAILURE;
+    } else if (sqlite3_changes(db_conn->conn) != 1) {
+      /* The conditions in the statement were not met */
+      return_status = BANKING_FAILURE;
+    }
+  }
+
+  release_statement(statement);
+  return return_status;
+}
+
+/*** GROUP COMMIT ********************************************************/
+
+enum db_request_type_t { DB_REQUEST_WITHDRAW, DB_REQUEST_TRANSFER };
+
+/*! \brief One balance mutation, owned by the thread waiting on it */
+struct db_request_t {
+  enum db_request_type_t type;
+  char * payer, * payee;
+  size_t payer_len, payee_len;
+  long int amount;
+  int status, done;
+  struct db_request_t * next;
+};
+
+/*! \brief A thread that applies balance mutations in batches
+ *
+ *  Submitters queue a request and sleep until it is resolved. The writer
+ *  gathers what arrives within window microseconds (up to batch requests),
+ *  applies each under its own savepoint, then commits them all at once. A
+ *  request is only reported successful after that commit, so it is exactly
+ *  as durable as if it had been committed alone.
+ */
+struct db_writer_t {
+  struct db_handle_t db_conn;
+  pthread_t thread;
+  int running, stopped;
+  unsigned int window;
+  size_t batch, depth;
+  struct db_request_t * head, * tail;
+  pthread_mutex_t mutex;
+  pthread_cond_t queued, resolved;
+};
+
+/*! \brief Apply a list of requests in one transaction (writer only)
+ *
+ *  A declined request is rolled back to its savepoint and fails alone. If
+ *  the transaction itself cannot be completed, every request fails.
+ */
+void
+commit_batch(struct db_handle_t * db_conn, struct db_request_t * batch)
+{
+  int status;
+  struct db_request_t * request;
+  struct account_record_t * record;
+
+  status = do_statement(db_conn, DB_BEGIN);
+  for (request = batch; request && status == BANKING_SUCCESS;
+                        request = request->next) {
+    if ((status = do_statement(db_conn, DB_SAVEPOINT))) {
+      break;
+    }
+    request->status = do_adjust(db_conn, DB_DEBIT_BALANCE,
+                                request->payer, request->payer_len,
+                                request->amount);
+    if (request->status == BANKING_SUCCESS
+     && request->type == DB_REQUEST_TRANSFER) {
+      request->status = do_adjust(db_conn, DB_CREDIT_BALANCE,
+                                  request->payee, request->payee_len,
+                                  request->amount);
+    }
+    /* Undo any half-applied request, then discard its savepoint */
+    if (request->status != BANKING_SUCCESS) {
+      status = do_statement(db_conn, DB_ROLLBACK_TO);
+    }
+    if (status == BANKING_SUCCESS) {
+      status = do_statement(db_conn, DB_RELEASE);
+    }
+  }
+  if (status == BANKING_SUCCESS) {
+    status = do_statement(db_conn, DB_COMMIT);
+  }
+
+  if (status != BANKING_SUCCESS) {
+    fprintf(stderr, "ERROR: unable to commit balance updates\n");
+    if (!sqlite3_get_autocommit(db_conn->conn)
+     && do_statement(db_conn, DB_ROLLBACK)) {
+      fprintf(stderr, "ERROR: unable to roll back balance updates\n");
+    }
+    for (request = batch; request; request = request->next) {
+      request->status = BANKING_FAILURE;
+    }
+    return;
+  }
+
+  /* Write through to the cache, now that every change is durable */
+  for (request = batch; request; request = request->next) {
+    if (request->status != BANKING_SUCCESS) {
+      continue;
+    }
+    if ((record = find_account(db_conn->cache, request->payer,
+                                               request->payer_len))) {
+      adjust_balance(record, -request->amount);
+    }
+    if (request->type == DB_REQUEST_TRANSFER
+     && (record = find_account(db_conn->cache, request->payee,
+                                                  request->payee_len))) {
+      adjust_balance(record, request->amount);
+    }
+  }
+}
+
+void *
+db_writer_routine(void * arg)
+{
+  size_t count;
+  struct timespec deadline;
+  struct db_request_t * batch, * last;
+  struct db_writer_t * writer = (struct db_writer_t *)(arg);
+
+  pthread_mutex_lock(&writer->mutex);
+  while (1) {
+    while (!writer->stopped && !writer->head) {
+      pthread_cond_wait(&writer->queued, &writer->mutex);
+    }
+    /* Once stopped, leave only after the queue is drained */
+    if (!writer->head) {
+      break;
+    }
+    /* Linger, so that concurrent requests may share the commit */
+    if (writer->window && !writer->stopped) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += (long)(writer->window % 1000000) * 1000;
+      deadline.tv_sec += writer->window / 1000000
+                       + deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      while (!writer->stopped && writer->depth < writer->batch
+          && pthread_cond_timedwait(&writer->queued, &writer->mutex,
+                                    &deadline) != ETIMEDOUT);
+    }
+    /* Detach up to batch requests from the front of the queue */
+    batch = last = writer->head;
+    for (count = 1; count < writer->batch && last->next; ++count) {
+      last = last->next;
+    }
+    if (!(writer->head = last->next)) {
+      writer->tail = NULL;
+    }
+    last->next = NULL;
+    writer->depth -= count;
+    pthread_mutex_unlock(&writer->mutex);
+
+    commit_batch(&writer->db_conn, batch);
+
+    /* Submitters cannot return (and so pop their requests) until we let go */
+    pthread_mutex_lock(&writer->mutex);
+    for (last = batch; last; last = last->next) {
+      last->done = 1;
+    }
+    pthread_cond_broadcast(&writer->resolved);
+  }
+  pthread_mutex_unlock(&writer->mutex);
+
+  return NULL;
+}
+
+/*! \brief Queue a request and wait until it has been committed (or not) */
+int
+submit_request(struct db_writer_t * writer, struct db_request_t * request)
+{
+  request->status = BANKING_FAILURE;
+  request->done = 0;
+  request->next = NULL;
+
+  pthread_mutex_lock(&writer->mutex);
+  if (writer->running && !writer->stopped) {
+    if (writer->tail) {
+      writer->tail->next = request;
+    } else {
+      writer->head = request;
+    }
+    writer->tail = request;
+    ++writer->depth;
+    pthread_cond_signal(&writer->queued);
+    while (!request->done) {
+      pthread_cond_wait(&writer->resolved, &writer->mutex);
+    }
+  }
+  pthread_mutex_unlock(&writer->mutex);
+
+  return request->status;
+}
+
+/*! \brief Resolve every queued request, then stop the writer */
+void
+destroy_db_writer(struct db_writer_t * writer)
+{
+  pthread_mutex_lock(&writer->mutex);
+  writer->stopped = 1;
+  pthread_cond_broadcast(&writer->queued);
+  pthread_mutex_unlock(&writer->mutex);
+
+  if (writer->running && pthread_join(writer->thread, NULL)) {
+    fprintf(stderr, "ERROR: failed to collect writer thread\n");
+  }
+  writer->running = 0;
+  destroy_db(NULL, &writer->db_conn);
+  pthread_cond_destroy(&writer->resolved);
+  pthread_cond_destroy(&writer->queued);
+  pthread_mutex_destroy(&writer->mutex);
+}
+
+/*! \brief Open a connection for the writer, then start it
+ *
+ *  The window and batch are filled in by the caller. Committed changes are
+ *  written through to the cache, unless it is NULL. Requests submitted to
+ *  a writer that failed to start are refused (see submit_request).
+ */
+int
+init_db_writer(const char * db_path, struct db_writer_t * writer,
+                                     struct account_cache_t * cache)
+{
+  writer->running = writer->stopped = 0;
+  writer->head = writer->tail = NULL;
+  writer->depth = 0;
+  memset(&writer->db_conn, '\0', sizeof(struct db_handle_t));
+  pthread_mutex_init(&writer->mutex, NULL);
+  pthread_cond_init(&writer->queued, NULL);
+  pthread_cond_init(&writer->resolved, NULL);
+
+  if (writer->batch < 1 || open_db(db_path, &writer->db_conn)) {
+    destroy_db_writer(writer);
+    return BANKING_FAILURE;
+  }
+  writer->db_conn.cache = cache;
+  if (pthread_create(&writer->thread, NULL, &db_writer_routine, writer)) {
+    fprintf(stderr, "ERROR: unable to start writer thread\n");
+    destroy_db_writer(writer);
+    return BANKING_FAILURE;
+  }
+  writer->running = 1;
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Debit amount from one account, only if it covers the amount
+ *
+ *  The check and the debit are a single statement.
+ */
+int
+do_withdraw(struct db_writer_t * writer,
+            char * name, size_t name_len, long int amount)
+{
+  struct db_request_t request;
+  memset(&request, '\0', sizeof(struct db_request_t));
+  request.type = DB_REQUEST_WITHDRAW;
+  request.payer = name;
+  request.payer_len = name_len;
+  request.amount = amount;
+  return submit_request(writer, &request);
+}
+
+/*! \brief Move amount between two accounts, or leave both untouched */
+int
+do_transfer(struct db_writer_t * writer,
+            char * payer, size_t payer_len,
+            char * payee, size_t payee_len, long int amount)
+{
+  struct db_request_t request;
+  memset(&request, '\0', sizeof(struct db_request_t));
+  request.type = DB_REQUEST_TRANSFER;
+  request.payer = payer;
+  request.payer_len = payer_len;
+  request.payee = payee;
+  request.payee_len = payee_len;
+  request.amount = amount;
+  return submit_request(writer, &request);
+}
+
 #endif /* DB_UTILS_H */
@@ -0,0 +1,257 @@
+/**
+ * Copyright 2011 by Tor E. Hagemann <hagemt@rpi.edu>
+ * This file is part of Plouton.
+ *
+ * Plouton is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Plouton is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Plouton.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENT_UTILS_H
+#define EVENT_UTILS_H
+
+/* Standard includes */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Thread includes */
+#include <pthread.h>
+
+/* Linux includes */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Local includes */
+#include "banking_constants.h"
+
+/*** EVENT SOURCES *******************************************************/
+
+enum event_type_t { EVENT_WAKEUP, EVENT_LISTENER, EVENT_CLIENT };
+
+/*! \brief Anything that may be watched by an event loop
+ *
+ *  Structures registered with the loop embed one of these as their first
+ *  member, so the pointer handed back by epoll may be cast back to them.
+ *  Sources are registered one-shot: once reported, a source belongs to
+ *  whichever worker dequeues it until that worker re-arms it.
+ */
+struct event_source_t {
+  int sock;
+  enum event_type_t type;
+  uint32_t events;
+  struct event_source_t * next;
+};
+
+/*! \brief An epoll instance paired with a queue of ready sources
+ *
+ *  One thread polls (see poll_events) and any number of workers consume
+ *  (see next_event). The depth of the queue and the number of consumers
+ *  waiting on it are tracked, so the poller can tell when it is outpaced.
+ */
+struct event_loop_t {
+  int epoll_fd;
+  volatile int stopped;
+  struct event_source_t wakeup;
+  struct event_source_t * head, * tail;
+  size_t depth, idle;
+  pthread_mutex_t queue_mutex;
+  pthread_cond_t queue_ready;
+};
+
+/*** INITIALIZATION AND TERMINATION **************************************/
+
+void
+destroy_event_loop(struct event_loop_t * loop)
+{
+  if (loop->wakeup.sock >= 0 && close(loop->wakeup.sock)) {
+    fprintf(stderr, "WARNING: unable to close wakeup descriptor\n");
+  }
+  if (loop->epoll_fd >= 0 && close(loop->epoll_fd)) {
+    fprintf(stderr, "WARNING: unable to close event descriptor\n");
+  }
+  loop->wakeup.sock = loop->epoll_fd = BANKING_FAILURE;
+  pthread_cond_destroy(&loop->queue_ready);
+  pthread_mutex_destroy(&loop->queue_mutex);
+}
+
+int
+init_event_loop(struct event_loop_t * loop)
+{
+  struct epoll_event event;
+
+  memset(loop, '\0', sizeof(struct event_loop_t));
+  pthread_mutex_init(&loop->queue_mutex, NULL);
+  pthread_cond_init(&loop->queue_ready, NULL);
+  loop->wakeup.type = EVENT_WAKEUP;
+
+  /* The wakeup descriptor is level-triggered, so every poll sees it */
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  loop->wakeup.sock = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->epoll_fd < 0 || loop->wakeup.sock < 0) {
+    fprintf(stderr, "ERROR: unable to create event descriptors\n");
+    destroy_event_loop(loop);
+    return BANKING_FAILURE;
+  }
+  memset(&event, '\0', sizeof(struct epoll_event));
+  event.events = EPOLLIN;
+  event.data.ptr = &loop->wakeup;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup.sock, &event)) {
+    fprintf(stderr, "ERROR: unable to watch wakeup descriptor\n");
+    destroy_event_loop(loop);
+    return BANKING_FAILURE;
+  }
+
+  return BANKING_SUCCESS;
+}
+
+/*** REGISTRATION ********************************************************/
+
+inline int
+watch_source(struct event_loop_t * loop, struct event_source_t * source,
+                                          uint32_t events) {
+  struct epoll_event event;
+  memset(&event, '\0', sizeof(struct epoll_event));
+  event.events = events | EPOLLONESHOT;
+  event.data.ptr = source;
+  return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->sock, &event)
+       ? BANKING_FAILURE : BANKING_SUCCESS;
+}
+
+inline int
+rearm_source(struct event_loop_t * loop, struct event_source_t * source,
+                                          uint32_t events) {
+  struct epoll_event event;
+  memset(&event, '\0', sizeof(struct epoll_event));
+  event.events = events | EPOLLONESHOT;
+  event.data.ptr = source;
+  return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, source->sock, &event)
+       ? BANKING_FAILURE : BANKING_SUCCESS;
+}
+
+inline int
+unwatch_source(struct event_loop_t * loop, struct event_source_t * source) {
+  /* Older kernels insist on a non-NULL event, even for deletion */
+  struct epoll_event event;
+  return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->sock, &event)
+       ? BANKING_FAILURE : BANKING_SUCCESS;
+}
+
+/*** DISPATCH ************************************************************/
+
+/*! \brief Wait for readiness, then queue every ready source
+ *
+ *  \param timeout Milliseconds to wait (-1 blocks indefinitely)
+ *  \return        BANKING_FAILURE once the loop has been stopped
+ */
+int
+poll_events(struct event_loop_t * loop, int timeout)
+{
+  int i, count;
+  struct event_source_t * source;
+  struct epoll_event events[MAX_EVENTS];
+
+  count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+  if (count < 0 && errno != EINTR) {
+    fprintf(stderr, "ERROR: unable to wait for events\n");
+    return BANKING_FAILURE;
+  }
+
+  pthread_mutex_lock(&loop->queue_mutex);
+  for (i = 0; i < count; ++i) {
+    source = (struct event_source_t *)(events[i].data.ptr);
+    if (source->type == EVENT_WAKEUP) {
+      continue;
+    }
+    /* Append to the queue, which a one-shot source can be in only once */
+    source->events = events[i].events;
+    source->next = NULL;
+    if (loop->tail) {
+      loop->tail->next = source;
+    } else {
+      loop->head = source;
+    }
+    loop->tail = source;
+    ++loop->depth;
+    pthread_cond_signal(&loop->queue_ready);
+  }
+  pthread_mutex_unlock(&loop->queue_mutex);
+
+  return loop->stopped ? BANKING_FAILURE : BANKING_SUCCESS;
+}
+
+/*! \brief Block until a ready source is queued
+ *
+ *  \param timeout Seconds to wait (0 waits indefinitely)
+ *  \return        NULL after a stop, or when the timeout elapses
+ */
+struct event_source_t *
+next_event(struct event_loop_t * loop, unsigned int timeout)
+{
+  int status = 0;
+  struct timespec deadline;
+  struct event_source_t * source;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout;
+
+  pthread_mutex_lock(&loop->queue_mutex);
+  ++loop->idle;
+  while (!loop->stopped && !loop->head && status != ETIMEDOUT) {
+    status = timeout
+           ? pthread_cond_timedwait(&loop->queue_ready,
+                                    &loop->queue_mutex, &deadline)
+           : pthread_cond_wait(&loop->queue_ready, &loop->queue_mutex);
+  }
+  --loop->idle;
+  if ((source = loop->stopped ? NULL : loop->head)) {
+    if (!(loop->head = source->next)) {
+      loop->tail = NULL;
+    }
+    source->next = NULL;
+    --loop->depth;
+  }
+  pthread_mutex_unlock(&loop->queue_mutex);
+
+  return source;
+}
+
+/*! \brief The number of queued sources no waiting consumer can take */
+inline size_t
+event_backlog(struct event_loop_t * loop) {
+  size_t backlog;
+  pthread_mutex_lock(&loop->queue_mutex);
+  backlog = (loop->depth > loop->idle) ? loop->depth - loop->idle : 0;
+  pthread_mutex_unlock(&loop->queue_mutex);
+  return backlog;
+}
+
+/*! \brief Release every thread blocked in poll_events or next_event */
+void
+stop_event_loop(struct event_loop_t * loop)
+{
+  uint64_t count = 1;
+
+  pthread_mutex_lock(&loop->queue_mutex);
+  loop->stopped = 1;
+  pthread_cond_broadcast(&loop->queue_ready);
+  pthread_mutex_unlock(&loop->queue_mutex);
+
+  if (write(loop->wakeup.sock, &count, sizeof(count)) != sizeof(count)) {
+    fprintf(stderr, "WARNING: unable to wake event loop\n");
+  }
+}
+
+#endif /* EVENT_UTILS_H */
@@ -0,0 +1,217 @@
+/**
+ * Copyright 2011 by Tor E. Hagemann <hagemt@rpi.edu>
+ * This file is part of Plouton.
+ *
+ * Plouton is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Plouton is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Plouton.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAME_UTILS_H
+#define FRAME_UTILS_H
+
+/* Standard includes */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Linux includes */
+#include <sys/types.h>
+
+/* Local includes */
+#include "banking_constants.h"
+
+/*** FRAME HEADERS *******************************************************/
+
+/*! \brief Which end sent a frame */
+enum frame_type_t {
+  FRAME_FIXED,   /* No header at all (see below) */
+  FRAME_REQUEST, /* From an ATM */
+  FRAME_REPLY    /* From the bank */
+};
+
+/*! \brief What precedes each variable-length frame, in the clear
+ *
+ *  Once both ends settle on a version at "hello" (see offer_framing), each
+ *  session frame starts with a header: the version and type, then (both
+ *  big-endian) the length of the body that follows and the sequence, the
+ *  sender's count of frames so far. The body is the payload, padded to a
+ *  whole number of FRAME_BLOCK_LENGTH blocks, plus the tag (if the suite
+ *  has one, in which case the header is authenticated along with it).
+ *
+ *  Fixed frames carry no header: always MAX_COMMAND_LENGTH bytes (plus any
+ *  tag). They remain for "hello", and for sessions with either end that
+ *  predates versions, so an older ATM or bank never sees a header.
+ *
+ *  Versions differ in what the header vouches for. Since version 2
+ *  (FRAME_VERSION_PROOF), a request under a tag is taken as proof enough
+ *  that the session is live, and so needs no probe ahead of it (see
+ *  self_proving, in crypto_utils.h). Since version 3 (FRAME_VERSION_TAGGED)
+ *  the header goes on to name a request (big-endian, too): whatever the
+ *  ATM chose for a request, and the request answered for a reply. So an
+ *  ATM may have several requests in flight, and know which is answered.
+ *  Version 4 (FRAME_VERSION_BINARY) keeps the header, but what it frames
+ *  changes: balance, withdraw and transfer are sent as binary messages,
+ *  not text (see message_utils.h), and answered in kind.
+ */
+struct frame_header_t {
+  unsigned char version, type;
+  uint16_t length;
+  uint32_t sequence, request;
+};
+
+/*! \brief The length of a header, by version */
+inline size_t
+frame_header_length(unsigned char version) {
+  return FRAME_HEADER_LENGTH
+       + ((version >= FRAME_VERSION_TAGGED) ? FRAME_REQUEST_LENGTH : 0);
+}
+
+inline void
+write_u32(unsigned char * buffer, uint32_t value) {
+  buffer[0] = (unsigned char)(value >> 24);
+  buffer[1] = (unsigned char)(value >> 16);
+  buffer[2] = (unsigned char)(value >> 8);
+  buffer[3] = (unsigned char)(value);
+}
+
+inline uint32_t
+read_u32(const unsigned char * buffer) {
+  return (uint32_t)(buffer[0]) << 24 | (uint32_t)(buffer[1]) << 16
+       | (uint32_t)(buffer[2]) << 8  | (uint32_t)(buffer[3]);
+}
+
+/*! \brief Write a header (by its version), returning its length */
+inline size_t
+write_frame_header(unsigned char * buffer,
+                   const struct frame_header_t * header) {
+  buffer[0] = header->version;
+  buffer[1] = header->type;
+  buffer[2] = (unsigned char)(header->length >> 8);
+  buffer[3] = (unsigned char)(header->length);
+  write_u32(buffer + 4, header->sequence);
+  if (header->version >= FRAME_VERSION_TAGGED) {
+    write_u32(buffer + FRAME_HEADER_LENGTH, header->request);
+  }
+  return frame_header_length(header->version);
+}
+
+/*! \brief Read a header (the whole of it, by its version), returning its
+ *         length (an untagged header names its own sequence as request)
+ */
+inline size_t
+read_frame_header(const unsigned char * buffer,
+                  struct frame_header_t * header) {
+  header->version = buffer[0];
+  header->type = buffer[1];
+  header->length = (uint16_t)(buffer[2] << 8 | buffer[3]);
+  header->sequence = read_u32(buffer + 4);
+  header->request = (header->version >= FRAME_VERSION_TAGGED)
+                  ? read_u32(buffer + FRAME_HEADER_LENGTH)
+                  : header->sequence;
+  return frame_header_length(header->version);
+}
+
+/*! \brief The bytes of a payload that are sent, in whole blocks (a payload
+ *         of zero length, i.e. unknown, is sent whole)
+ */
+inline size_t
+padded_length(size_t len) {
+  len = (len + FRAME_BLOCK_LENGTH - 1) & ~(size_t)(FRAME_BLOCK_LENGTH - 1);
+  return (!len || len > MAX_COMMAND_LENGTH) ? MAX_COMMAND_LENGTH : len;
+}
+
+/*! \brief The length of the frame at the start of len bytes of data
+ *
+ *  The first FRAME_HEADER_LENGTH bytes of a header are enough to say this
+ *  (even if the header goes on, see frame_header_length).
+ *
+ *  \return The length of the whole frame (which may be more than len), 0
+ *          if the header is incomplete, or BANKING_FAILURE if the header
+ *          is not one we understand
+ */
+inline ssize_t
+frame_extent(const unsigned char * data, size_t len) {
+  size_t head;
+  uint16_t length;
+  if (len < FRAME_HEADER_LENGTH) {
+    return 0;
+  }
+  head = frame_header_length(data[0]);
+  length = (uint16_t)(data[2] << 8 | data[3]);
+  if (!data[0] || data[0] > FRAME_VERSION
+   || (data[1] != FRAME_REQUEST && data[1] != FRAME_REPLY)
+   || length > MAX_FRAME_LENGTH - head) {
+    return BANKING_FAILURE;
+  }
+  return (ssize_t)(head + length);
+}
+
+/*** NEGOTIATION *********************************************************/
+
+/*! \brief Write a version (AUTH_FRAME_MSG, then it) into a message
+ *
+ *  The ATM offers its latest at "hello", and the bank answers with the
+ *  version chosen (see accept_framing), if any. Either end that predates
+ *  versions leaves nonce where it would be.
+ */
+inline void
+offer_framing(char * buffer, unsigned char version) {
+  memcpy(buffer, AUTH_FRAME_MSG, sizeof(AUTH_FRAME_MSG));
+  buffer[sizeof(AUTH_FRAME_MSG)] = (char)(version);
+}
+
+/*! \brief The version both ends speak, given the other's (by offer_framing),
+ *         or 0 for fixed frames
+ */
+inline unsigned char
+accept_framing(const char * buffer) {
+  unsigned char version = (unsigned char)(buffer[sizeof(AUTH_FRAME_MSG)]);
+  if (memcmp(buffer, AUTH_FRAME_MSG, sizeof(AUTH_FRAME_MSG))) {
+    return 0;
+  }
+  return (version < FRAME_VERSION) ? version : FRAME_VERSION;
+}
+
+/*** DIAGNOSTICS *********************************************************/
+
+/*! \brief Describe each whole frame among len bytes of data
+ *
+ *  Anything that does not parse (a fixed frame, or part of a frame) ends
+ *  the description, so this is only a best effort for what is relayed.
+ *
+ *  \return The number of frames described
+ */
+size_t
+print_frames(FILE * fp, const unsigned char * data, size_t len)
+{
+  size_t count = 0;
+  ssize_t extent;
+  struct frame_header_t header;
+
+  while ((extent = frame_extent(data, len)) > 0
+      && (size_t)(extent) <= len) {
+    read_frame_header(data, &header);
+    fprintf(fp, "INFO: frame v%u %s [seq: %lu, request: %lu, "
+                "%u byte body]\n",
+            (unsigned)(header.version),
+            (header.type == FRAME_REQUEST) ? "request" : "reply",
+            (unsigned long)(header.sequence),
+            (unsigned long)(header.request), (unsigned)(header.length));
+    data += extent;
+    len -= (size_t)(extent);
+    ++count;
+  }
+  return count;
+}
+
+#endif /* FRAME_UTILS_H */
@@ -0,0 +1,191 @@
+/**
+ * Copyright 2011 by Tor E. Hagemann <hagemt@rpi.edu>
+ * This file is part of Plouton.
+ *
+ * Plouton is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Plouton is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Plouton.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOCK_UTILS_H
+#define LOCK_UTILS_H
+
+/* Standard includes */
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Thread includes */
+#include <pthread.h>
+
+/* Local includes */
+#include "banking_constants.h"
+
+/*** LOCK STRIPES ********************************************************/
+
+/*! \brief One mutex, guarding every account whose name hashes to it
+ *
+ *  Each stripe sits on its own cache line. A lock attempt that finds the
+ *  stripe already held is counted as contended before it blocks.
+ */
+struct lock_stripe_t {
+  pthread_mutex_t mutex;
+  unsigned long acquired, contended;
+} __attribute__((aligned(64)));
+
+/*! \brief A fixed table of LOCK_STRIPES stripes
+ *
+ *  Operations on one account take its stripe (see lock_account), those on
+ *  two take both stripes in index order (see lock_accounts), so accounts on
+ *  distinct stripes never wait on each other and no two threads deadlock.
+ */
+struct lock_table_t {
+  struct lock_stripe_t stripes[LOCK_STRIPES];
+};
+
+void
+destroy_lock_table(struct lock_table_t * table)
+{
+  size_t i;
+  for (i = 0; i < LOCK_STRIPES; ++i) {
+    pthread_mutex_destroy(&table->stripes[i].mutex);
+  }
+}
+
+void
+init_lock_table(struct lock_table_t * table)
+{
+  size_t i;
+  memset(table, '\0', sizeof(struct lock_table_t));
+  for (i = 0; i < LOCK_STRIPES; ++i) {
+    pthread_mutex_init(&table->stripes[i].mutex, NULL);
+  }
+}
+
+/*! \brief Map an account name to its stripe (ignoring case, as SQLite) */
+inline size_t
+stripe_of(const char * name, size_t len) {
+  uint32_t hash = UINT32_C(0x811C9DC5);
+  for (len = strnlen(name, len); len; --len) {
+    hash ^= (unsigned char)(tolower((unsigned char)(*name++)));
+    hash *= UINT32_C(0x01000193);
+  }
+  return (size_t)(hash % LOCK_STRIPES);
+}
+
+/*** LOCKING *************************************************************/
+
+inline void
+lock_stripe(struct lock_table_t * table, size_t i) {
+  struct lock_stripe_t * stripe = &table->stripes[i];
+  if (pthread_mutex_trylock(&stripe->mutex) == EBUSY) {
+    __atomic_add_fetch(&stripe->contended, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&stripe->mutex);
+  }
+  /* Written with the lock held, but read by stats without it */
+  __atomic_add_fetch(&stripe->acquired, 1, __ATOMIC_RELAXED);
+}
+
+inline void
+unlock_stripe(struct lock_table_t * table, size_t i) {
+  pthread_mutex_unlock(&table->stripes[i].mutex);
+}
+
+/*! \brief Lock one account, returning the stripe to give to unlock */
+inline size_t
+lock_account(struct lock_table_t * table, const char * name, size_t len) {
+  size_t i = stripe_of(name, len);
+  lock_stripe(table, i);
+  return i;
+}
+
+/*! \brief Lock two accounts, in canonical (stripe index) order
+ *
+ *  Both indices are stored, in the order taken; when the accounts share a
+ *  stripe it is taken only once, and *second is set to LOCK_STRIPES.
+ */
+void
+lock_accounts(struct lock_table_t * table,
+              const char * a, size_t a_len,
+              const char * b, size_t b_len,
+              size_t * first, size_t * second)
+{
+  size_t i, j;
+
+  i = stripe_of(a, a_len);
+  j = stripe_of(b, b_len);
+  *first = (i < j) ? i : j;
+  *second = (i == j) ? LOCK_STRIPES : (i < j) ? j : i;
+  lock_stripe(table, *first);
+  if (*second != LOCK_STRIPES) {
+    lock_stripe(table, *second);
+  }
+}
+
+/*! \brief Release what lock_accounts took, in reverse order */
+inline void
+unlock_accounts(struct lock_table_t * table, size_t first, size_t second) {
+  if (second != LOCK_STRIPES) {
+    unlock_stripe(table, second);
+  }
+  unlock_stripe(table, first);
+}
+
+/*** STATISTICS **********************************************************/
+
+/*! \brief Print totals, then the most contended stripes (up to count) */
+void
+print_lock_stats(struct lock_table_t * table, FILE * out, size_t count)
+{
+  size_t i, j, found, hottest;
+  unsigned long acquired, contended, value, ceiling;
+
+  acquired = contended = 0;
+  for (i = 0; i < LOCK_STRIPES; ++i) {
+    acquired += __atomic_load_n(&table->stripes[i].acquired,
+                                __ATOMIC_RELAXED);
+    contended += __atomic_load_n(&table->stripes[i].contended,
+                                 __ATOMIC_RELAXED);
+  }
+  fprintf(out, "Account locks: %lu acquired, %lu contended (%.2f%%)\n",
+          acquired, contended,
+          acquired ? 100.0 * (double)(contended) / (double)(acquired) : 0.0);
+
+  /* Selection by repeated scans (ordered by count, then by index) */
+  ceiling = (unsigned long)(-1);
+  for (j = 0, hottest = 0; j < count; ++j) {
+    found = LOCK_STRIPES;
+    for (i = 0, value = 0; i < LOCK_STRIPES; ++i) {
+      contended = __atomic_load_n(&table->stripes[i].contended,
+                                  __ATOMIC_RELAXED);
+      if (contended && (contended < ceiling
+                     || (contended == ceiling && i > hottest))
+       && (found == LOCK_STRIPES || contended > value)) {
+        value = contended;
+        found = i;
+      }
+    }
+    if (found == LOCK_STRIPES) {
+      break;
+    }
+    fprintf(out, "\tstripe %3lu: %lu acquired, %lu contended\n",
+            (unsigned long)(found),
+            __atomic_load_n(&table->stripes[found].acquired,
+                            __ATOMIC_RELAXED), value);
+    ceiling = value;
+    hottest = found;
+  }
+}
+
+#endif /* LOCK_UTILS_H */
@@ -0,0 +1,176 @@
+/**
+ * Copyright 2011 by Tor E. Hagemann <hagemt@rpi.edu>
+ * This file is part of Plouton.
+ *
+ * Plouton is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Plouton is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Plouton.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MESSAGE_UTILS_H
+#define MESSAGE_UTILS_H
+
+/* Standard includes */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Local includes */
+#include "banking_constants.h"
+
+/*** MESSAGES ************************************************************/
+
+/*! \brief What a binary message asks for (or, in a reply, answers) */
+enum opcode_t {
+  OP_NONE,     /* Never sent (so a text command is never mistaken) */
+  OP_BALANCE,  /* Look up the balance of the account logged in */
+  OP_WITHDRAW, /* Take amount from it */
+  OP_TRANSFER, /* Move amount from it to the account named */
+  OP_COUNT
+};
+
+/*! \brief How a request went (always STATUS_OK in a request) */
+enum status_t {
+  STATUS_OK,
+  STATUS_INVALID,      /* The amount was out of bounds */
+  STATUS_INSUFFICIENT, /* The balance was less than the amount */
+  STATUS_DECLINED,     /* Otherwise refused (e.g. no such recipient) */
+  STATUS_ERROR,        /* No account to speak of */
+  STATUS_COUNT
+};
+
+/*! \brief A balance, withdraw or transfer request, or its reply
+ *
+ *  Once both ends settle on FRAME_VERSION_BINARY, these three travel as
+ *  below in place of text: the opcode and status, then the amount (eight
+ *  bytes, little-endian, two's complement), then the length of the name
+ *  and its bytes, if any (MESSAGE_FIXED_LENGTH bytes in all, and then the
+ *  name). A request names the recipient of a transfer; a reply names the
+ *  account whose balance it gives, or the recipient, once more.
+ *
+ *  Nothing is allocated either way: a message read names the bytes of
+ *  the buffer it was read from, so the name is not terminated, and lasts
+ *  only as long as that buffer. Text is left to render_message.
+ */
+struct message_t {
+  unsigned char opcode, status;
+  int64_t amount;
+  const char * name;
+  size_t namelength;
+};
+
+/*! \brief Whether a command is a binary message (text never starts so) */
+inline int
+is_message(const char * buffer) {
+  unsigned char opcode = (unsigned char)(buffer[0]);
+  return opcode > OP_NONE && opcode < OP_COUNT;
+}
+
+inline void
+write_le64(unsigned char * buffer, int64_t value) {
+  int i;
+  uint64_t bits = (uint64_t)(value);
+  for (i = 0; i < 8; ++i, bits >>= 8) {
+    buffer[i] = (unsigned char)(bits);
+  }
+}
+
+inline int64_t
+read_le64(const unsigned char * buffer) {
+  int i;
+  uint64_t bits = 0;
+  for (i = 7; i >= 0; --i) {
+    bits = bits << 8 | buffer[i];
+  }
+  return (int64_t)(bits);
+}
+
+/*! \brief Write a message into a buffer of MAX_COMMAND_LENGTH bytes
+ *
+ *  \return The bytes written, or 0 if the name does not fit
+ */
+inline size_t
+write_message(unsigned char * buffer, const struct message_t * message) {
+  if (message->namelength > MAX_NAME_LENGTH) {
+    return 0;
+  }
+  buffer[0] = message->opcode;
+  buffer[1] = message->status;
+  write_le64(buffer + 2, message->amount);
+  buffer[10] = (unsigned char)(message->namelength);
+  memcpy(buffer + MESSAGE_FIXED_LENGTH, message->name, message->namelength);
+  return MESSAGE_FIXED_LENGTH + message->namelength;
+}
+
+/*! \brief Read a message from the first len bytes of a buffer
+ *
+ *  \return BANKING_SUCCESS, or BANKING_FAILURE if the message is not one
+ *          we understand, or overruns len
+ */
+inline int
+read_message(const unsigned char * buffer, size_t len,
+             struct message_t * message) {
+  if (len < MESSAGE_FIXED_LENGTH || !is_message((const char *)(buffer))
+   || buffer[1] >= STATUS_COUNT
+   || buffer[10] > len - MESSAGE_FIXED_LENGTH) {
+    return BANKING_FAILURE;
+  }
+  message->opcode = buffer[0];
+  message->status = buffer[1];
+  message->amount = read_le64(buffer + 2);
+  message->namelength = buffer[10];
+  message->name = (const char *)(buffer + MESSAGE_FIXED_LENGTH);
+  return BANKING_SUCCESS;
+}
+
+/*** RENDERING ***********************************************************/
+
+/*! \brief Describe a reply as text (as the bank did, before binary) */
+void
+render_message(char * buffer, size_t len, const struct message_t * reply)
+{
+  static const char * const nouns[OP_COUNT] = {
+    NULL, "balance", "withdrawal", "transfer"
+  };
+  static const char * const errors[OP_COUNT] = {
+    NULL, "BALANCE ERROR", "WITHDRAW ERROR", "TRANSFER ERROR"
+  };
+  long amount = (long)(reply->amount);
+  int namelength = (int)(reply->namelength);
+
+  switch (reply->status) {
+  case STATUS_OK:
+    if (reply->opcode == OP_BALANCE) {
+      snprintf(buffer, len, "%.*s, your balance is $%li.",
+               namelength, reply->name, amount);
+    } else if (reply->opcode == OP_WITHDRAW) {
+      snprintf(buffer, len, "Withdrew $%li", amount);
+    } else {
+      snprintf(buffer, len, "Transfered $%li to %.*s",
+               amount, namelength, reply->name);
+    }
+    break;
+  case STATUS_INVALID:
+    snprintf(buffer, len, "Invalid %s amount.", nouns[reply->opcode]);
+    break;
+  case STATUS_INSUFFICIENT:
+    snprintf(buffer, len, "Insufficient funds.");
+    break;
+  case STATUS_DECLINED:
+    snprintf(buffer, len, "Cannot complete %s.", nouns[reply->opcode]);
+    break;
+  default:
+    snprintf(buffer, len, "%s", errors[reply->opcode]);
+  }
+}
+
+#endif /* MESSAGE_UTILS_H */
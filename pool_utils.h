@@ -0,0 +1,191 @@
+/**
+ * Copyright 2011 by Tor E. Hagemann <hagemt@rpi.edu>
+ * This file is part of Plouton.
+ *
+ * Plouton is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Plouton is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Plouton.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POOL_UTILS_H
+#define POOL_UTILS_H
+
+/* Standard includes */
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Thread includes */
+#include <pthread.h>
+
+/* Local includes */
+#include "banking_constants.h"
+
+/*** WORKER POOL *********************************************************/
+
+enum worker_state_t { WORKER_FREE, WORKER_LIVE, WORKER_RETIRED };
+
+struct worker_pool_t;
+
+/*! \brief One slot in a pool, handed to the routine as its argument */
+struct worker_t {
+  pthread_t id;
+  enum worker_state_t state;
+  struct worker_pool_t * pool;
+};
+
+/*! \brief A set of threads sized between min_workers and max_workers
+ *
+ *  The pool only grows when asked (see grow_worker_pool) and only shrinks
+ *  when a worker volunteers (see retire_worker), so the policy belongs to
+ *  whoever owns the pool. Retired slots are joined before they are reused.
+ */
+struct worker_pool_t {
+  struct worker_t * workers;
+  size_t min_workers, max_workers, live;
+  unsigned int idle_timeout;
+  void * (*routine)(void *);
+  void * arg;
+  pthread_mutex_t mutex;
+};
+
+/*! \brief Start one more worker, if the pool permits (pool mutex held) */
+int
+spawn_worker(struct worker_pool_t * pool)
+{
+  size_t i;
+  struct worker_t * worker;
+
+  if (pool->live >= pool->max_workers) {
+    return BANKING_FAILURE;
+  }
+  /* Find a slot, collecting any worker that retired from it */
+  for (i = 0; i < pool->max_workers; ++i) {
+    worker = &pool->workers[i];
+    if (worker->state == WORKER_RETIRED) {
+      if (pthread_join(worker->id, NULL)) {
+        fprintf(stderr, "ERROR: failed to collect worker thread\n");
+        continue;
+      }
+      worker->state = WORKER_FREE;
+    }
+    if (worker->state == WORKER_FREE) {
+      worker->pool = pool;
+      worker->state = WORKER_LIVE;
+      if (pthread_create(&worker->id, NULL, pool->routine, worker)) {
+        worker->state = WORKER_FREE;
+        fprintf(stderr, "WARNING: unable to start worker thread\n");
+        return BANKING_FAILURE;
+      }
+      ++pool->live;
+      return BANKING_SUCCESS;
+    }
+  }
+  return BANKING_FAILURE;
+}
+
+/*! \brief Start up to count more workers */
+void
+grow_worker_pool(struct worker_pool_t * pool, size_t count)
+{
+  pthread_mutex_lock(&pool->mutex);
+  while (count-- && spawn_worker(pool) == BANKING_SUCCESS);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/*! \brief Called by an idle worker, BANKING_SUCCESS if it may exit */
+int
+retire_worker(struct worker_t * worker)
+{
+  int status = BANKING_FAILURE;
+  struct worker_pool_t * pool = worker->pool;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->live > pool->min_workers) {
+    worker->state = WORKER_RETIRED;
+    --pool->live;
+    status = BANKING_SUCCESS;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return status;
+}
+
+/*! \brief Collect every worker, live or retired
+ *
+ *  Live workers are expected to be on their way out (so, the caller has
+ *  already told them to stop); this blocks until each of them returns.
+ */
+void
+destroy_worker_pool(struct worker_pool_t * pool)
+{
+  size_t i;
+  enum worker_state_t state;
+
+  if (!pool->workers) {
+    return;
+  }
+  /* Workers may still retire meanwhile, so never join with the lock */
+  for (i = 0; i < pool->max_workers; ++i) {
+    pthread_mutex_lock(&pool->mutex);
+    state = pool->workers[i].state;
+    pthread_mutex_unlock(&pool->mutex);
+    if (state != WORKER_FREE) {
+      if (pthread_join(pool->workers[i].id, NULL)) {
+        fprintf(stderr, "ERROR: failed to collect worker thread\n");
+      } else {
+        #ifndef NDEBUG
+        fprintf(stderr, "INFO: collected worker thread\n");
+        #endif
+      }
+      pthread_mutex_lock(&pool->mutex);
+      pool->workers[i].state = WORKER_FREE;
+      pthread_mutex_unlock(&pool->mutex);
+    }
+  }
+  pool->live = 0;
+  free(pool->workers);
+  pool->workers = NULL;
+  pthread_mutex_destroy(&pool->mutex);
+}
+
+int
+init_worker_pool(struct worker_pool_t * pool, void * (*routine)(void *),
+                                              void * arg)
+{
+  /* Sanity check (the bounds themselves are filled in by the caller) */
+  if (pool->min_workers < MIN_WORKERS
+   || pool->max_workers > MAX_WORKERS
+   || pool->min_workers > pool->max_workers) {
+    fprintf(stderr,
+            "ERROR: worker bounds must be within [%i, %i]\n",
+            MIN_WORKERS, MAX_WORKERS);
+    return BANKING_FAILURE;
+  }
+  if (!(pool->workers = calloc(pool->max_workers,
+                               sizeof(struct worker_t)))) {
+    return BANKING_FAILURE;
+  }
+  pool->live = 0;
+  pool->routine = routine;
+  pool->arg = arg;
+  pthread_mutex_init(&pool->mutex, NULL);
+
+  /* Start the minimum number of workers */
+  grow_worker_pool(pool, pool->min_workers);
+  if (pool->live < pool->min_workers) {
+    destroy_worker_pool(pool);
+    return BANKING_FAILURE;
+  }
+  return BANKING_SUCCESS;
+}
+
+#endif /* POOL_UTILS_H */
@@ -18,6 +18,8 @@
 
 /* Standard includes */
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,13 +27,14 @@
 #include <time.h>
 
 /* Local includes */
+#include "frame_utils.h"
 #include "socket_utils.h"
 
 struct proxy_session_data_t {
   int csock, ssock, conn, count;
   enum mode_t { A2B, B2A } mode;
   time_t established, terminated;
-  unsigned char buffer[MAX_COMMAND_LENGTH];
+  unsigned char buffer[MAX_FRAME_LENGTH];
   struct sigaction signal_action;
   sigset_t termination_signals;
 } session_data;
@@ -57,7 +60,7 @@ handle_signal(int signum)
   }
 
   /* Clear the internal buffer */
-  memset(session_data.buffer, '\0', MAX_COMMAND_LENGTH);
+  memset(session_data.buffer, '\0', MAX_FRAME_LENGTH);
 
   /* Re-raise the proper termination signals */
   if (sigismember(&session_data.termination_signals, signum)) {
@@ -88,38 +91,56 @@ handle_connection(int sock, int * conn)
   return BANKING_FAILURE;
 }
 
-inline int
-handle_relay(ssize_t * r, ssize_t * s) {
+/*! \brief Relay whatever either end sends next, exactly as received
+ *
+ *  Frames differ in length by cipher suite (and framing), so nothing is
+ *  assumed about them: each read is forwarded in full, in whichever
+ *  direction it came. Any variable-length frames are described as well.
+ */
+int
+handle_relay(ssize_t * r, ssize_t * s)
+{
+  int from, to;
+  ssize_t len;
+  struct pollfd fds[2];
   assert(r && s);
 
   /* We will buffer a single message */
-  memset(session_data.buffer, '\0', MAX_COMMAND_LENGTH);
-
-  /* Handle an ATM to BANK communication */
-  if (session_data.mode == A2B) {
-    if ((*r = recv(session_data.conn,
-                   session_data.buffer, MAX_COMMAND_LENGTH, 0)) > 0
-     && (*s = send(session_data.csock,
-                   session_data.buffer, MAX_COMMAND_LENGTH, 0)) > 0) {
-      ++session_data.count;
-      session_data.mode = B2A;
-      return BANKING_SUCCESS;
+  memset(session_data.buffer, '\0', MAX_FRAME_LENGTH);
+
+  /* Wait for either the ATM or the BANK to say something */
+  fds[0].fd = session_data.conn;
+  fds[1].fd = session_data.csock;
+  fds[0].events = fds[1].events = POLLIN;
+  while (poll(fds, 2, -1) < 0) {
+    if (errno != EINTR) {
+      return BANKING_FAILURE;
     }
   }
+  if (fds[0].revents) {
+    session_data.mode = A2B;
+    from = session_data.conn;
+    to = session_data.csock;
+  } else {
+    session_data.mode = B2A;
+    from = session_data.csock;
+    to = session_data.conn;
+  }
 
-  /* Handle a BANK to ATM communication */
-  if (session_data.mode == B2A) {
-    if ((*r = recv(session_data.csock,
-                   session_data.buffer, MAX_COMMAND_LENGTH, 0)) > 0
-     && (*s = send(session_data.conn,
-                   session_data.buffer, MAX_COMMAND_LENGTH, 0)) > 0) {
-      ++session_data.count;
-      session_data.mode = A2B;
-      return BANKING_SUCCESS;
+  /* Forward the bytes actually received, and nothing more */
+  if ((*r = recv(from, session_data.buffer, MAX_FRAME_LENGTH, 0)) <= 0) {
+    return BANKING_FAILURE;
+  }
+  #ifndef NDEBUG
+  print_frames(stderr, session_data.buffer, (size_t)(*r));
+  #endif
+  for (*s = 0; *s < *r; *s += len) {
+    if ((len = send(to, session_data.buffer + *s, *r - *s, 0)) <= 0) {
+      return BANKING_FAILURE;
     }
   }
-
-  return BANKING_FAILURE;
+  ++session_data.count;
+  return BANKING_SUCCESS;
 }
 
 int
@@ -155,7 +176,8 @@ main(int argc, char ** argv)
     fprintf(stderr, "ERROR: unable to connect to server\n");
     return EXIT_FAILURE;
   }
-  if ((session_data.ssock = init_server_socket(argv[1])) < 0) {
+  if ((session_data.ssock = init_server_socket(argv[1],
+                                               BANKING_BACKLOG, 0)) < 0) {
     fprintf(stderr, "ERROR: unable to start server\n");
     destroy_socket(session_data.csock);
     return EXIT_FAILURE;
@@ -172,20 +194,20 @@ main(int argc, char ** argv)
         if (bytes < 0) { bytes = -bytes; }
         fprintf(stderr, "ERROR: %li byte(s) lost\n", (long)(bytes));
       }
-      /* NOTE: modality is swapped after relay */
+      /* NOTE: modality is the direction of the last relay */
       if (session_data.mode == A2B) {
         fprintf(stderr,
-                "INFO: server sent message [id: %08i]\n",
+                "INFO: client sent message [id: %08i]\n",
                 session_data.count);
       }
       if (session_data.mode == B2A) {
         fprintf(stderr,
-                "INFO: client sent message [id: %08i]\n",
+                "INFO: server sent message [id: %08i]\n",
                 session_data.count);
       }
       #ifndef NDEBUG
       /* Report entire transmission */
-      hexdump(stderr, session_data.buffer, MAX_COMMAND_LENGTH);
+      hexdump(stderr, session_data.buffer, (size_t)(received));
       #endif
     }
     time(&session_data.terminated);
@@ -0,0 +1,267 @@
+/**
+ * Copyright 2011 by Tor E. Hagemann <hagemt@rpi.edu>
+ * This file is part of Plouton.
+ *
+ * Plouton is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Plouton is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Plouton.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SLAB_UTILS_H
+#define SLAB_UTILS_H
+
+/* Standard includes */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Linux includes */
+#include <sys/mman.h>
+
+/* Thread includes */
+#ifdef USING_PTHREADS
+#include <pthread.h>
+#endif
+
+/* Local includes */
+#include "banking_constants.h"
+
+/*** SLAB POOL ***********************************************************/
+
+/*! \brief Fixed-size slots carved from locked (unswappable) slabs
+ *
+ *  Slots are numbered across slabs, and a free slot holds the number of
+ *  the next free slot (plus one, so zero ends the list) in its first four
+ *  bytes. The head of the free list pairs that number with a tag bumped
+ *  on every change, so allocation and release are a compare-and-swap on
+ *  one word, and a slot that was taken and returned meanwhile (ABA) will
+ *  not be mistaken for the same head. Only growth, which maps a new slab
+ *  and pushes all of its slots at once, takes a lock. Slabs are unmapped
+ *  only by destroy_slab_pool, so a stale read of a free slot is harmless.
+ */
+struct slab_pool_t {
+  uint64_t head;
+  unsigned char ** slabs;
+  size_t slot_size, slot_count, length, count, limit, in_use;
+  int locked;
+  #ifdef USING_PTHREADS
+  pthread_mutex_t mutex;
+  #endif
+};
+
+/*! \brief Zero memory in a way the compiler may not elide */
+inline void
+wipe_bytes(void * bytes, size_t len) {
+  volatile unsigned char * p = bytes;
+  while (len--) {
+    *p++ = 0;
+  }
+}
+
+/*! \brief The address of slot i (which must belong to a mapped slab) */
+inline unsigned char *
+slab_slot(struct slab_pool_t * pool, uint32_t i) {
+  return pool->slabs[i / pool->slot_count]
+       + (i % pool->slot_count) * pool->slot_size;
+}
+
+/*! \brief Push a chain of slots, first through last, onto the free list */
+inline void
+push_slots(struct slab_pool_t * pool, uint32_t first, uint32_t last) {
+  uint32_t link;
+  uint64_t head, next;
+  head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+  do {
+    /* Whatever is free now follows the last slot in the chain */
+    link = (uint32_t)(head);
+    memcpy(slab_slot(pool, last), &link, sizeof(uint32_t));
+    next = ((head >> 32) + 1) << 32 | (uint64_t)(first + 1);
+  } while (!__atomic_compare_exchange_n(&pool->head, &head, next, 1,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_ACQUIRE));
+}
+
+/*! \brief Map, lock and free one more slab (pool mutex held) */
+int
+grow_slab_pool(struct slab_pool_t * pool)
+{
+  uint32_t i, first;
+  unsigned char * slab;
+
+  if (pool->count >= pool->limit) {
+    return BANKING_FAILURE;
+  }
+  slab = mmap(NULL, pool->length, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (slab == MAP_FAILED) {
+    fprintf(stderr, "ERROR: unable to map key slab\n");
+    return BANKING_FAILURE;
+  }
+  /* Without privileges (or rlimits) to lock, we still run, but say so */
+  if (mlock(slab, pool->length)) {
+    if (pool->locked) {
+      fprintf(stderr, "WARNING: unable to lock key slab in memory\n");
+    }
+    pool->locked = 0;
+  }
+  #ifdef MADV_DONTDUMP
+  madvise(slab, pool->length, MADV_DONTDUMP);
+  #endif
+
+  /* Chain the slots together, then publish them all at once */
+  first = (uint32_t)(pool->count * pool->slot_count);
+  pool->slabs[pool->count] = slab;
+  __atomic_store_n(&pool->count, pool->count + 1, __ATOMIC_RELEASE);
+  for (i = first; i + 1 < first + pool->slot_count; ++i) {
+    *(uint32_t *)(slab_slot(pool, i)) = i + 2;
+  }
+  push_slots(pool, first, i);
+  #ifndef NDEBUG
+  fprintf(stderr, "INFO: key slab %lu mapped (%lu slots, %s)\n",
+          (unsigned long)(pool->count), (unsigned long)(pool->slot_count),
+          pool->locked ? "locked" : "UNLOCKED");
+  #endif
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Take a slot, growing the pool if need be (NULL when exhausted) */
+void *
+alloc_slot(struct slab_pool_t * pool)
+{
+  uint32_t next;
+  uint64_t head;
+  unsigned char * slot;
+
+  head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+  for (;;) {
+    if (!(uint32_t)(head)) {
+      /* Empty: one thread grows the pool, the rest find it grown */
+      #ifdef USING_PTHREADS
+      pthread_mutex_lock(&pool->mutex);
+      #endif
+      head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+      if (!(uint32_t)(head) && grow_slab_pool(pool)) {
+        #ifdef USING_PTHREADS
+        pthread_mutex_unlock(&pool->mutex);
+        #endif
+        return NULL;
+      }
+      #ifdef USING_PTHREADS
+      pthread_mutex_unlock(&pool->mutex);
+      #endif
+      head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+      continue;
+    }
+    slot = slab_slot(pool, (uint32_t)(head) - 1);
+    memcpy(&next, slot, sizeof(uint32_t));
+    if (__atomic_compare_exchange_n(&pool->head, &head,
+                                    ((head >> 32) + 1) << 32 | next, 1,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+      memset(slot, '\0', sizeof(uint32_t));
+      return slot;
+    }
+  }
+}
+
+/*! \brief Wipe a slot, then return it to the free list */
+void
+free_slot(struct slab_pool_t * pool, void * slot)
+{
+  size_t i, count;
+  uint32_t index;
+
+  if (!slot) {
+    return;
+  }
+  /* Find the slab this came from (slabs are few, so a scan will do) */
+  count = __atomic_load_n(&pool->count, __ATOMIC_ACQUIRE);
+  for (i = 0; i < count; ++i) {
+    if ((unsigned char *)(slot) >= pool->slabs[i]
+     && (unsigned char *)(slot) < pool->slabs[i] + pool->length) {
+      break;
+    }
+  }
+  if (i == count) {
+    fprintf(stderr, "ERROR: attempt to free a foreign key slot\n");
+    return;
+  }
+  index = (uint32_t)(i * pool->slot_count
+        + ((unsigned char *)(slot) - pool->slabs[i]) / pool->slot_size);
+  wipe_bytes(slot, pool->slot_size);
+  __atomic_sub_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+  push_slots(pool, index, index);
+}
+
+/*** INITIALIZATION AND TERMINATION **************************************/
+
+void
+destroy_slab_pool(struct slab_pool_t * pool)
+{
+  size_t i;
+
+  for (i = 0; i < pool->count; ++i) {
+    wipe_bytes(pool->slabs[i], pool->length);
+    munlock(pool->slabs[i], pool->length);
+    munmap(pool->slabs[i], pool->length);
+  }
+  free(pool->slabs);
+  pool->slabs = NULL;
+  pool->head = 0;
+  pool->count = pool->in_use = 0;
+  #ifdef USING_PTHREADS
+  pthread_mutex_destroy(&pool->mutex);
+  #endif
+}
+
+/*! \brief Prepare slots of size bytes, slot_count per slab, up to limit
+ *         slabs (the first of which is mapped now)
+ */
+int
+init_slab_pool(struct slab_pool_t * pool, size_t size,
+               size_t slot_count, size_t limit)
+{
+  long page = sysconf(_SC_PAGESIZE);
+
+  memset(pool, '\0', sizeof(struct slab_pool_t));
+  /* Slots are aligned, and big enough to hold the free list's links */
+  pool->slot_size = (size < sizeof(uint32_t)) ? sizeof(uint32_t) : size;
+  pool->slot_size = (pool->slot_size + 15) & ~(size_t)(15);
+  pool->slot_count = slot_count;
+  pool->limit = limit;
+  /* Slabs are whole pages (and any slack becomes more slots) */
+  if (page <= 0) {
+    page = 4096;
+  }
+  pool->length = (slot_count * pool->slot_size + (size_t)(page) - 1)
+               & ~((size_t)(page) - 1);
+  pool->slot_count = pool->length / pool->slot_size;
+  pool->locked = 1;
+  if (!slot_count || !limit
+   || (uint64_t)(pool->slot_count) * limit >= UINT32_MAX
+   || !(pool->slabs = calloc(limit, sizeof(unsigned char *)))) {
+    fprintf(stderr, "ERROR: unable to allocate key slabs\n");
+    return BANKING_FAILURE;
+  }
+  #ifdef USING_PTHREADS
+  pthread_mutex_init(&pool->mutex, NULL);
+  #endif
+  if (grow_slab_pool(pool)) {
+    destroy_slab_pool(pool);
+    return BANKING_FAILURE;
+  }
+  return BANKING_SUCCESS;
+}
+
+#endif /* SLAB_UTILS_H */
@@ -20,8 +20,10 @@
 #define SOCKET_UTILS_H
 
 /* Standard includes */
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 /* Networking includes */
@@ -122,10 +124,17 @@ init_client_socket(const char * port)
   return sock;
 }
 
+/*! \brief Open a listening socket
+ *
+ *  \param backlog The length of the queue of pending connections
+ *  \param shared  If non-zero, set SO_REUSEPORT, so that several sockets
+ *                 may listen on the same port (the kernel will spread
+ *                 incoming connections amongst them)
+ */
 int
-init_server_socket(const char * port)
+init_server_socket(const char * port, int backlog, int shared)
 {
-  int sock;
+  int sock, option;
   struct sockaddr_in local_addr;
   socklen_t addr_len = sizeof(local_addr);
   if ((sock = create_socket(port, &local_addr)) < 0) {
@@ -133,13 +142,22 @@ init_server_socket(const char * port)
     return BANKING_FAILURE;
   }
 
+  /* Sharing must be arranged prior to binding */
+  option = 1;
+  if (shared && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                           &option, sizeof(option))) {
+    fprintf(stderr, "ERROR: unable to share socket\n");
+    destroy_socket(sock);
+    return BANKING_FAILURE;
+  }
+
   /* Perform bind and listen */
   if (bind(sock, (struct sockaddr *)(&local_addr), addr_len)) {
     fprintf(stderr, "ERROR: unable to bind socket\n");
     destroy_socket(sock);
     return BANKING_FAILURE;
   }
-  if (listen(sock, MAX_CONNECTIONS)) {
+  if (listen(sock, backlog)) {
     fprintf(stderr, "ERROR: unable to listen on socket\n");
     destroy_socket(sock);
     return BANKING_FAILURE;
@@ -159,6 +177,27 @@ init_server_socket(const char * port)
 
 /*** UTILITIES ***********************************************************/
 
+inline int
+set_nonblocking(int sock) {
+  int flags;
+  /* Preserve whatever flags are already present */
+  if ((flags = fcntl(sock, F_GETFL, 0)) < 0
+   || fcntl(sock, F_SETFL, flags | O_NONBLOCK)) {
+    fprintf(stderr, "ERROR: unable to make socket non-blocking\n");
+    return BANKING_FAILURE;
+  }
+  return BANKING_SUCCESS;
+}
+
+/*! \brief Whether the other end has hung up (checked without blocking) */
+inline int
+socket_closed(int sock) {
+  char byte;
+  ssize_t len = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+                              && errno != EINTR);
+}
+
 inline void
 hexdump(FILE * fp, unsigned char * buffer, size_t len) {
   size_t i, j;